@@ -1,21 +1,27 @@
 #pragma once
+#include "heartbeat_wheel.hpp"
+#include <netpp/buffer_pool.h>
+#include <netpp/config.h>
 #include <netpp/connection.h>
+#include <netpp/mpsc_queue.h>
 
 #include <asio/basic_stream_socket.hpp>
 #include <asio/buffer.hpp>
 #include <asio/error.hpp>
 #include <asio/io_service.hpp>
+#include <asio/post.hpp>
 #include <asio/read.hpp>
 #include <asio/steady_timer.hpp>
 #include <asio/strand.hpp>
 #include <asio/write.hpp>
-#include <asio/use_future.hpp>
 #include <asio/dispatch.hpp>
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <condition_variable>
 #include <deque>
 #include <thread>
 #include <mutex>
-#include <future>
 
 namespace net
 {
@@ -41,7 +47,7 @@ namespace net
 //  | await_output |                      |
 //  |              |<---+                 |
 //  +--------------+    |                 |
-//      |      |        | async_wait()    |
+//      |      |        | post()          |
 //      |      +--------+                 |
 //      V                                 |
 //  +-------------+               +--------------+
@@ -50,13 +56,17 @@ namespace net
 //  |             |               |              |
 //  +-------------+               +--------------+
 //
-// The output actor first waits for an output message to be enqueued. It does
-// this by using a steady_timer as an asynchronous condition variable. The
-// steady_timer will be signalled whenever the output queue is non-empty.
+// Messages are sent from any thread through a lock-free queue, of which
+// the output actor is the only consumer. When it finds nothing to send the
+// actor goes to sleep by clearing the output_scheduled_ flag. The first
+// message sent after that sets the flag again and posts the actor to the strand.
 //
 // Once a message is available, it is sent to the endpoint. After the message is
-// successfully sent, the output actor again waits for the output queue to
-// become non-empty.
+// successfully sent, the output actor checks for more output.
+//
+// With direct writes enabled a sender which finds the actor asleep takes the
+// flag itself and writes on its own thread as much as the socket accepts
+// without blocking. Only the remainder is handed to the actor.
 
 template <typename buffer_t>
 struct stateful_buffer
@@ -64,7 +74,141 @@ struct stateful_buffer
     buffer_t buffer{};
     std::size_t offset{};
 };
-using output_buffer = stateful_buffer<byte_buffer>;
+
+struct output_buffer : stateful_buffer<byte_buffer>
+{
+    const uint8_t* data() const
+    {
+        return shared.empty() ? buffer.data() : shared.data();
+    }
+
+    std::size_t size() const
+    {
+        return shared.empty() ? buffer.size() : shared.size();
+    }
+
+    /// buffer shared with other connections, written instead of 'buffer' when set
+    shared_buffer shared;
+
+    /// whether this is the last buffer of a frame,
+    /// after which frames of other messages may be written
+    bool frame_end{};
+
+    /// whether this is the last buffer of a message
+    bool msg_end{};
+};
+
+//----------------------------------------------------------------------
+/// The frames of a sent message waiting to be taken by the output actor.
+struct output_msg
+{
+    bool empty() const
+    {
+        return frame.empty() && shared.empty();
+    }
+
+    std::size_t size() const
+    {
+        std::size_t size = 0;
+        for(const auto& buffer : frame)
+        {
+            size += buffer.size();
+        }
+        for(const auto& frame : shared)
+        {
+            for(const auto& buffer : frame)
+            {
+                size += buffer.size();
+            }
+        }
+        return size;
+    }
+
+    /// buffers of a message built as a single frame
+    std::vector<byte_buffer> frame;
+
+    /// frames of shared buffers, sent instead of 'frame'. e.g. frames shared
+    /// with other connections or the frames of a split message.
+    std::vector<std::vector<shared_buffer>> shared;
+
+    /// bytes of the first buffer which are already written
+    std::size_t offset{};
+
+    /// whether any of the frame is already written,
+    /// in which case the rest of it has to follow right away
+    bool partial{};
+
+    /// priority lane of the message
+    std::size_t lane{};
+};
+
+//----------------------------------------------------------------------
+/// Appends the buffers of a frame to the queue.
+inline void queue_frame(std::deque<output_buffer>& queue, std::vector<byte_buffer>& frame, bool msg_end)
+{
+    for(auto& buffer : frame)
+    {
+        queue.emplace_back();
+        queue.back().buffer = std::move(buffer);
+    }
+    queue.back().frame_end = true;
+    queue.back().msg_end = msg_end;
+}
+
+inline void queue_frame(std::deque<output_buffer>& queue, std::vector<shared_buffer>& frame, bool msg_end)
+{
+    for(auto& buffer : frame)
+    {
+        queue.emplace_back();
+        queue.back().shared = std::move(buffer);
+    }
+    queue.back().frame_end = true;
+    queue.back().msg_end = msg_end;
+}
+
+//----------------------------------------------------------------------
+/// The messages of a priority lane.
+struct output_lane
+{
+    /// buffers of the messages made of a single frame, in order
+    std::deque<output_buffer> queue;
+
+    /// buffers of the messages made of several frames,
+    /// which take turns in writing a frame each
+    std::deque<std::deque<output_buffer>> streams;
+
+    /// buffers of the messages made of several frames which wait for
+    /// a stream to complete, as the peer keeps only so many open.
+    /// Not written before they are moved to 'streams'.
+    std::deque<std::deque<output_buffer>> held;
+
+    /// whether the next frame is taken from the streams
+    bool streams_turn{};
+
+    bool empty() const
+    {
+        return queue.empty() && streams.empty();
+    }
+};
+
+//----------------------------------------------------------------------
+/// A view over a range of buffers usable as an asio buffer sequence.
+template <typename buffer_t>
+struct buffer_span
+{
+    const buffer_t* begin() const
+    {
+        return first;
+    }
+
+    const buffer_t* end() const
+    {
+        return last;
+    }
+
+    const buffer_t* first{};
+    const buffer_t* last{};
+};
 using raw_buffer = std::array<uint8_t, std::numeric_limits<uint16_t>::max()>;
 using input_buffer = stateful_buffer<raw_buffer>;
 
@@ -76,7 +220,8 @@ public:
     /// Constructor of connection accepting a ready socket.
     //-----------------------------------------------------------------------------
     asio_connection(std::shared_ptr<socket_type> socket, const msg_builder::creator& builder_creator,
-                    asio::io_service& context, std::chrono::seconds heartbeat = std::chrono::seconds(0));
+                    asio::io_service& context, std::chrono::seconds heartbeat = std::chrono::seconds(0),
+                    const connection_config& config = {});
 
     //-----------------------------------------------------------------------------
     /// Starts the connection. Awaiting input and output
@@ -90,6 +235,12 @@ public:
     void stop(const error_code& ec) override;
     virtual void stop_socket();
 
+    //-----------------------------------------------------------------------------
+    /// Stops the connection once the output is drained and the peer closed
+    /// its side, or once 'linger' passes.
+    //-----------------------------------------------------------------------------
+    void stop_gracefully(const error_code& ec, std::chrono::milliseconds linger) override;
+
     //-----------------------------------------------------------------------------
     /// Starts the async read operation awaiting for data
     /// to be read from the socket.
@@ -114,8 +265,58 @@ public:
     //-----------------------------------------------------------------------------
     virtual int64_t handle_write(const error_code& ec, std::size_t size);
 
+    //-----------------------------------------------------------------------------
+    /// Writes as much of the buffers as the socket accepts without blocking,
+    /// from outside of the strand. Connections which cannot do that write nothing.
+    /// Called with socket_guard_ held.
+    //-----------------------------------------------------------------------------
+    virtual std::size_t write_some_direct(const buffer_span<asio::const_buffer>& buffers, error_code& ec);
+
 protected:
-    std::vector<asio::const_buffer> get_output_buffers() const;
+    //-----------------------------------------------------------------------------
+    /// Gets the buffers of the next write prepared by the output actor.
+    //-----------------------------------------------------------------------------
+    buffer_span<asio::const_buffer> get_output_buffers() const;
+
+    //-----------------------------------------------------------------------------
+    /// Ends a graceful stop once the output is drained. Stream oriented
+    /// connections override it to shut down their sending side and wait for
+    /// the peer to close its side. Should only be called by the output actor.
+    //-----------------------------------------------------------------------------
+    virtual void half_close();
+
+    //-----------------------------------------------------------------------------
+    /// Decides whether to write now, and if so prepares the buffers of the next
+    /// write. Otherwise makes the output actor wait for more output.
+    /// Should only be called by the output actor.
+    //-----------------------------------------------------------------------------
+    bool prepare_output();
+
+    //-----------------------------------------------------------------------------
+    /// Puts the output actor to sleep. Wakes it again if
+    /// a message was sent while it was going to sleep.
+    //-----------------------------------------------------------------------------
+    void release_output();
+
+    //-----------------------------------------------------------------------------
+    /// Writes the message on the calling thread as far as possible and drops
+    /// the written buffers. Should only be called by the sender which woke the
+    /// output actor, before the actor runs.
+    //-----------------------------------------------------------------------------
+    void write_direct(output_msg& out);
+
+    //-----------------------------------------------------------------------------
+    /// Checks whether the payload of the builder operation should be streamed
+    /// to the on_msg_chunk subscribers instead of being buffered whole.
+    //-----------------------------------------------------------------------------
+    bool should_stream(const msg_builder::operation& operation) const;
+
+    //-----------------------------------------------------------------------------
+    /// Callback to be called whenever a chunk of a streamed payload was read
+    /// or an error occured. Completes the builder operation after the last chunk.
+    //-----------------------------------------------------------------------------
+    int64_t handle_stream_chunk(const error_code& ec, byte_buffer&& chunk);
+
     //-----------------------------------------------------------------------------
     /// Checks whether the connection is stopped i.e the stop method
     /// has been called at least once.
@@ -125,7 +326,87 @@ protected:
     //-----------------------------------------------------------------------------
     /// Sends the message through the specified channel
     //-----------------------------------------------------------------------------
-    void send_msg(byte_buffer&& msg, data_channel channel) override;
+    send_status send_msg(byte_buffer&& msg, data_channel channel) override;
+
+    //-----------------------------------------------------------------------------
+    /// Sends a message serialized into a buffer got from the builder
+    /// through the specified channel
+    //-----------------------------------------------------------------------------
+    send_status send_msg_in_place(byte_buffer&& msg, data_channel channel) override;
+
+    //-----------------------------------------------------------------------------
+    /// Sends a frame shared with other connections through the specified channel
+    //-----------------------------------------------------------------------------
+    send_status send_shared(const std::vector<std::vector<shared_buffer>>& frames,
+                            data_channel channel) override;
+
+    //-----------------------------------------------------------------------------
+    /// Applies the policy of the high watermark before queuing a message.
+    /// Returns send_status::queued if the message may be queued.
+    //-----------------------------------------------------------------------------
+    send_status wait_for_room();
+
+    //-----------------------------------------------------------------------------
+    /// Queues a framed message and wakes the output actor if needed.
+    //-----------------------------------------------------------------------------
+    send_status queue_output(output_msg&& out);
+
+    //-----------------------------------------------------------------------------
+    /// Frames and queues the message on the specified priority lane
+    /// regardless of the high watermark.
+    //-----------------------------------------------------------------------------
+    send_status queue_msg(byte_buffer&& msg, data_channel channel, std::size_t lane);
+
+    //-----------------------------------------------------------------------------
+    /// Gets the priority lane of the messages sent through the channel.
+    //-----------------------------------------------------------------------------
+    std::size_t get_lane(data_channel channel) const;
+
+    //-----------------------------------------------------------------------------
+    /// Moves whole frames from the priority lanes to the output queue
+    /// in the order they are to be written, as many as the next write takes.
+    /// Should only be called by the output actor.
+    //-----------------------------------------------------------------------------
+    void commit_output();
+
+    //-----------------------------------------------------------------------------
+    /// Moves the next frame of the lane to the output queue.
+    /// Returns the bytes moved.
+    /// Should only be called by the output actor.
+    //-----------------------------------------------------------------------------
+    std::size_t commit_frame(output_lane& lane);
+
+    //-----------------------------------------------------------------------------
+    /// Adds a message made of several frames to the streams of the lane,
+    /// or holds it back if the peer has as many open as it accepts.
+    /// Returns the queue to append its frames to.
+    /// Should only be called by the output actor.
+    //-----------------------------------------------------------------------------
+    std::deque<output_buffer>& open_stream(output_lane& lane);
+
+    //-----------------------------------------------------------------------------
+    /// Picks the lane to write the next message from.
+    /// Returns false if all lanes are empty.
+    /// Should only be called by the output actor.
+    //-----------------------------------------------------------------------------
+    bool next_lane(std::size_t& lane);
+
+    //-----------------------------------------------------------------------------
+    /// Checks whether the output queue reached the configured high watermark.
+    //-----------------------------------------------------------------------------
+    bool over_high_water() const;
+
+    //-----------------------------------------------------------------------------
+    /// Checks whether the output queue drained to the configured low watermark.
+    //-----------------------------------------------------------------------------
+    bool under_low_water() const;
+
+    //-----------------------------------------------------------------------------
+    /// Notifies the subscribers if the output queue
+    /// reached its high watermark or drained after it.
+    //-----------------------------------------------------------------------------
+    void check_high_water();
+    void check_drained();
 
     //-----------------------------------------------------------------------------
     /// Awaits for output in the output queue. If the output queue is
@@ -139,24 +420,38 @@ protected:
     void check_heartbeat();
 
     //-----------------------------------------------------------------------------
-    /// Sends a heartbeat.
+    /// Sends a heartbeat. It is written by the output actor, unless
+    /// other output is written along with it.
     //-----------------------------------------------------------------------------
     void send_heartbeat();
 
     //-----------------------------------------------------------------------------
-    /// Shedules a heartbeat.
+    /// Sends a heartbeat if nothing was written since the last time
+    /// a heartbeat was considered.
+    //-----------------------------------------------------------------------------
+    void send_heartbeat_if_idle();
+
+    //-----------------------------------------------------------------------------
+    /// Sends a heartbeat if nothing was written since the last time a heartbeat
+    /// was considered, or if the peer was silent since the previous call.
     //-----------------------------------------------------------------------------
-    void schedule_heartbeat();
+    void send_idle_heartbeat();
 
     //-----------------------------------------------------------------------------
-    /// Awaits for the heartbeat timer.
+    /// Schedules the next heartbeat check.
     //-----------------------------------------------------------------------------
     void await_heartbeat();
 
     //-----------------------------------------------------------------------------
-    /// Updates a heartbeat
+    /// Schedules the next heartbeat sent when the output is idle.
+    //-----------------------------------------------------------------------------
+    void await_idle_heartbeat();
+
+    //-----------------------------------------------------------------------------
+    /// Notes traffic, which makes heartbeats unnecessary.
     //-----------------------------------------------------------------------------
-    void update_heartbeat_timestamp();
+    void mark_received();
+    void mark_sent();
 
     //-----------------------------------------------------------------------------
     /// Get local endpoint (hostname/ip address) as string
@@ -173,36 +468,147 @@ protected:
     //-----------------------------------------------------------------------------
     std::string get_endpoint() const;
 
-    /// guard for shared data access
-    mutable std::mutex guard_;
+    //-----------------------------------------------------------------------------
+    /// Gets the details passed to the subscribers of a received message.
+    /// They are only formatted again when the endpoints change,
+    /// which for stream oriented (tcp) connections is never.
+    //-----------------------------------------------------------------------------
+    const details& get_details();
+
+    /// config this connection was created with
+    connection_config config_;
+
+    /// recycler for the buffers of the builder, the output
+    /// queue and the messages delivered to subscribers.
+    buffer_pool_ptr pool_;
+
+    /// bytes of the payload being streamed delivered so far
+    std::size_t stream_offset_{};
+
+    /// messages sent from any thread waiting to be taken by the output actor
+    mpsc_queue<output_msg> pending_output_;
+
+    /// whether the output actor is running or about to run,
+    /// in which case senders do not need to wake it.
+    /// Held until start, which wakes the actor for what was sent before.
+    std::atomic<bool> output_scheduled_{true};
 
+    /// bytes sent which are not written yet
+    std::atomic<std::size_t> queued_bytes_{};
+
+    /// messages sent which are not fully written yet
+    std::atomic<std::size_t> queued_msgs_{};
+
+    /// whether the output queue reached its high watermark
+    /// and did not drain to the low one since.
+    /// Changed under high_water_guard_ so that blocked senders can wait for it.
+    std::atomic<bool> above_high_water_{false};
+
+    /// guard for the high watermark changes
+    std::mutex high_water_guard_;
+
+    /// signalled when the output queue drains or the connection stops
+    std::condition_variable drained_;
+
+    /// messages taken from pending_output_, highest priority first.
+    /// Only accessed by the output actor.
+    std::vector<output_lane> lanes_;
+
+    /// frames each lane may still write before
+    /// the lanes after it get their turn.
+    /// Only accessed by the output actor.
+    std::vector<std::size_t> lane_credits_;
+
+    /// streams of all the lanes, which are not held back.
+    /// Only accessed by the output actor.
+    std::size_t open_streams_{};
+
+    /// buffers taken from the lanes in the order they are written.
     /// deque to avoid elements invalidation when resizing
-    /// Access to this member should be guarded by a lock
+    /// Only accessed by the output actor.
     std::deque<output_buffer> output_queue_;
 
+    /// when the messages held back for coalescing are to be written
+    /// Only accessed by the output actor.
+    asio::steady_timer::time_point coalesce_deadline_{};
+
+    /// whether a write is in progress
+    /// Only accessed by the output actor.
+    bool writing_{};
+
+    /// whether the output actor waits on the coalesce_timer_
+    /// Only accessed by the output actor.
+    bool coalescing_{};
+
+    /// asio does not pass more buffers than this to a single system call
+    static constexpr std::size_t max_write_buffers = 64;
+
+    /// guard for closing the socket while a sender writes to it directly.
+    /// The strand only takes it to close or shut down the socket.
+    std::mutex socket_guard_;
+
+    /// buffers of the write in progress, covering the front of the output queue.
+    /// Reused by every write. Only accessed by the output actor.
+    std::array<asio::const_buffer, max_write_buffers> write_buffers_{};
+    std::size_t write_buffers_count_{};
+
+    /// whether everything queued has been written and the output actor waits.
+    /// Only accessed by the output actor.
+    bool output_idle_{true};
+
     /// a strand for async socket callback synchronization
     std::shared_ptr<asio::io_service::strand> strand_;
 
     /// the socket this connection is using.
     std::shared_ptr<socket_type> socket_;
 
-    /// steady_timer as an asynchronous condition variable.
-    /// The steady_timer will be signalled whenever the
-    /// output queue is non-empty.
-    /// Access to this member should be guarded by a lock
-    asio::steady_timer non_empty_output_queue_;
+    /// a steady timer to write the messages held back for coalescing
+    /// Only accessed by the output actor.
+    asio::steady_timer coalesce_timer_;
+
+    /// whether a graceful stop is in progress. Sends are refused meanwhile.
+    std::atomic<bool> closing_{false};
+
+    /// whether the output is drained and half_close was called
+    /// Only accessed by the output actor.
+    bool half_closed_{};
+
+    /// error code the graceful stop was requested with
+    /// Only accessed on the strand.
+    error_code close_error_;
+
+    /// a steady timer to end a graceful stop which takes too long
+    /// Only accessed on the strand.
+    asio::steady_timer linger_timer_;
 
     /// heartbeat interval
     std::chrono::seconds heartbeat_check_interval_;
-    /// a steady timer to tick for heartbeat checks
-    asio::steady_timer heartbeat_check_timer_;
-    /// a steady timer to issue a heartbeat reply
-    asio::steady_timer heartbeat_reply_timer_;
-    /// the last time a heartbeat was sent/recieved
-    std::atomic<asio::steady_timer::duration> heartbeat_timestamp_{};
+    /// the heartbeat checks and replies of all connections of
+    /// the io context are driven by its single heartbeat wheel
+    heartbeat_wheel::entry heartbeat_check_;
+    heartbeat_wheel::entry heartbeat_idle_;
+
+    /// whether anything was received since the last heartbeat check.
+    /// Any traffic proves the peer alive, not only heartbeats.
+    std::atomic<bool> received_{false};
+
+    /// whether anything was received since the last idle heartbeat was considered
+    std::atomic<bool> heard_{false};
+
+    /// whether anything was written since a heartbeat was last considered.
+    /// Any traffic serves as a heartbeat for the peer.
+    std::atomic<bool> sent_{false};
+
+    /// whether a heartbeat waits to be taken by the output actor
+    std::atomic<bool> heartbeat_due_{false};
+
+    /// the heartbeat frame, built once and written without copying
+    shared_buffer heartbeat_frame_;
 
     /// a security flag to tell us if we are still connected.
-    std::atomic<bool> connected_{false};
+    /// Set from creation, so that sends before start are queued
+    /// and a stop before start is not undone by it.
+    std::atomic<bool> connected_{true};
 
     using socket_endpoint = typename socket_type::lowest_layer_type::endpoint_type;
 
@@ -210,19 +616,32 @@ protected:
     socket_endpoint local_endpoint_;
     socket_endpoint remote_endpoint_;
     socket_endpoint endpoint_;
+
+    /// details of the connection as last formatted
+    details details_;
+
+    /// the endpoints the details were formatted from
+    socket_endpoint details_local_endpoint_;
+    socket_endpoint details_remote_endpoint_;
+    socket_endpoint details_endpoint_;
+    bool details_formatted_{};
 };
 
 template <typename socket_type>
 inline asio_connection<socket_type>::asio_connection(std::shared_ptr<socket_type> socket,
                                                      const msg_builder::creator& builder_creator,
                                                      asio::io_service& context,
-                                                     std::chrono::seconds heartbeat)
-    : strand_(std::make_shared<asio::io_service::strand>(context))
+                                                     std::chrono::seconds heartbeat,
+                                                     const connection_config& config)
+    : config_(config)
+    , pool_(std::make_shared<buffer_pool>(config.buffer_pool_size, config.buffer_pool_max_capacity))
+    , strand_(std::make_shared<asio::io_service::strand>(context))
     , socket_(std::move(socket))
-    , non_empty_output_queue_(context)
+    , coalesce_timer_(context)
+    , linger_timer_(context)
     , heartbeat_check_interval_(heartbeat)
-    , heartbeat_check_timer_(context)
-    , heartbeat_reply_timer_(context)
+    , heartbeat_check_(heartbeat_wheel::get(context))
+    , heartbeat_idle_(heartbeat_wheel::get(context))
 
 {
     error_code ec;
@@ -230,27 +649,59 @@ inline asio_connection<socket_type>::asio_connection(std::shared_ptr<socket_type
     remote_endpoint_ = socket_->lowest_layer().remote_endpoint(ec);
     socket_->lowest_layer().non_blocking(true, ec);
 
-    // The non_empty_output_queue_ steady_timer is set to the maximum time
-    // point whenever the output queue is empty. This ensures that the output
-    // actor stays asleep until a message is put into the queue.
-    non_empty_output_queue_.expires_at(asio::steady_timer::time_point::max());
-    heartbeat_check_timer_.expires_at(asio::steady_timer::time_point::max());
-    heartbeat_reply_timer_.expires_at(asio::steady_timer::time_point::max());
+    heartbeat_check_.callback = [this]() {
+        if(!stopped())
+        {
+            check_heartbeat();
+        }
+    };
+    heartbeat_idle_.callback = [this]() {
+        if(!stopped())
+        {
+            send_idle_heartbeat();
+            await_idle_heartbeat();
+        }
+    };
+
+    lanes_.resize(std::max<std::size_t>(config_.lane_weights.size(), 1));
+    lane_credits_ = config_.lane_weights;
 
     builder = builder_creator();
+    builder->set_buffer_pool(pool_);
+    builder->set_max_msg_size(config_.max_msg_size);
+
+    // A heartbeat is a message with no payload on channel 0.
+    byte_buffer frame;
+    for(const auto& buffer : builder->build({}, 0).frame)
+    {
+        frame.insert(std::end(frame), std::begin(buffer), std::end(buffer));
+    }
+    heartbeat_frame_ = shared_buffer(std::move(frame));
+
+    if(config_.on_msg_chunk)
+    {
+        on_msg_chunk.emplace_back(config_.on_msg_chunk);
+    }
 }
 
 template <typename socket_type>
 inline void asio_connection<socket_type>::start()
 {
-    connected_ = true;
+    if(stopped())
+    {
+        return;
+    }
+
     asio::dispatch(*strand_, std::bind(&asio_connection::start_read, this->shared_from_this()));
     asio::dispatch(*strand_, std::bind(&asio_connection::await_output, this->shared_from_this()));
 
     if(heartbeat_check_interval_ > std::chrono::seconds::zero())
     {
+        heartbeat_check_.owner = this->shared_from_this();
+        heartbeat_idle_.owner = this->shared_from_this();
         send_heartbeat();
         await_heartbeat();
+        await_idle_heartbeat();
     }
 }
 
@@ -261,27 +712,90 @@ inline void asio_connection<socket_type>::stop(const error_code& ec)
     {
         return;
     }
-    {
-        std::lock_guard<std::mutex> lock(guard_);
-        non_empty_output_queue_.cancel();
-        heartbeat_check_timer_.cancel();
-        heartbeat_reply_timer_.cancel();
+    heartbeat_check_.wheel.cancel(heartbeat_check_);
+    heartbeat_idle_.wheel.cancel(heartbeat_idle_);
 
-        auto future = asio::dispatch(*strand_, asio::use_future(std::bind(&asio_connection::stop_socket, this->shared_from_this())));
-        future.wait();
+    {
+        // Wake the senders blocked on the high watermark.
+        std::lock_guard<std::mutex> lock(high_water_guard_);
+        drained_.notify_all();
     }
 
-    {
+    // The socket is closed on the strand, which may be running this very call.
+    // Nothing waits for it there, the subscribers are notified from it instead.
+    asio::dispatch(*strand_, [this, ec, sentinel = this->shared_from_this()]() {
+        coalesce_timer_.cancel();
+        linger_timer_.cancel();
+        stop_socket();
+
+        // A graceful stop reports why it was requested, not how the peer reacted.
+        auto reason = closing_ && close_error_ ? close_error_ : ec;
         for(const auto& callback : on_disconnect)
         {
-            callback(id, ec ? ec : asio::error::make_error_code(asio::error::connection_aborted));
+            callback(id, reason ? reason : asio::error::make_error_code(asio::error::connection_aborted));
         }
+    });
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::stop_gracefully(const error_code& ec, std::chrono::milliseconds linger)
+{
+    if(linger.count() <= 0)
+    {
+        stop(ec);
+        return;
+    }
+
+    if(stopped() || closing_.exchange(true))
+    {
+        return;
+    }
+
+    {
+        // Wake the senders blocked on the high watermark, they are refused now.
+        std::lock_guard<std::mutex> lock(high_water_guard_);
+        drained_.notify_all();
     }
+
+    asio::dispatch(*strand_, [this, ec, linger, sentinel = this->shared_from_this()]() {
+        close_error_ = ec;
+        if(stopped())
+        {
+            return;
+        }
+
+        linger_timer_.expires_after(linger);
+        linger_timer_.async_wait(strand_->wrap([this, sentinel](const error_code& timer_ec) {
+            if(!timer_ec)
+            {
+                stop(close_error_);
+            }
+        }));
+
+        // Write whatever is held back for coalescing right away. Otherwise
+        // the output actor is woken like for a sent message, as it may be
+        // held by a direct writer or until start meanwhile.
+        if(coalescing_)
+        {
+            coalesce_timer_.cancel();
+        }
+        else if(!output_scheduled_.exchange(true))
+        {
+            asio::post(*strand_, std::bind(&asio_connection::await_output, this->shared_from_this()));
+        }
+    });
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::half_close()
+{
+    stop(close_error_);
 }
 
 template <typename socket_type>
 inline void asio_connection<socket_type>::stop_socket()
 {
+    std::lock_guard<std::mutex> lock(socket_guard_);
     if(socket_->lowest_layer().is_open())
     {
         error_code ec;
@@ -297,68 +811,575 @@ inline bool asio_connection<socket_type>::stopped() const
 }
 
 template <typename socket_type>
-inline void asio_connection<socket_type>::send_msg(byte_buffer&& msg, data_channel channel)
+inline send_status asio_connection<socket_type>::send_msg(byte_buffer&& msg, data_channel channel)
+{
+    auto status = wait_for_room();
+    if(status != send_status::queued)
+    {
+        return status;
+    }
+
+    return queue_msg(std::move(msg), channel, get_lane(channel));
+}
+
+template <typename socket_type>
+inline send_status asio_connection<socket_type>::send_msg_in_place(byte_buffer&& msg, data_channel channel)
 {
+    auto status = wait_for_room();
+    if(status != send_status::queued)
+    {
+        return status;
+    }
+
     // we assume this is thread safe as it is const.
-    auto buffers = builder->build(std::move(msg), channel);
+    auto frames = builder->build(std::move(msg), channel, true);
+    output_msg out;
+    out.frame = std::move(frames.frame);
+    out.shared = std::move(frames.split);
+    out.lane = get_lane(channel);
+    return queue_output(std::move(out));
+}
 
-    std::lock_guard<std::mutex> lock(guard_);
-    for(auto& buffer : buffers)
+template <typename socket_type>
+inline send_status
+asio_connection<socket_type>::send_shared(const std::vector<std::vector<shared_buffer>>& frames,
+                                          data_channel channel)
+{
+    auto status = wait_for_room();
+    if(status != send_status::queued)
     {
-        output_queue_.emplace_back();
-        output_queue_.back().buffer = std::move(buffer);
+        return status;
     }
 
-    // Signal that the output queue contains messages. Modifying the expiry
-    // will wake the output actor, if it is waiting on the timer.
-    non_empty_output_queue_.expires_at(asio::steady_timer::time_point::min());
+    output_msg out;
+    out.shared = frames;
+    out.lane = get_lane(channel);
+    return queue_output(std::move(out));
 }
 
 template <typename socket_type>
-inline void asio_connection<socket_type>::await_output()
+inline send_status asio_connection<socket_type>::wait_for_room()
 {
-    if(stopped())
+    if(closing_ || stopped())
     {
-        return;
+        return send_status::disconnected;
     }
 
-    auto check_if_empty = [&]() {
-        std::lock_guard<std::mutex> lock(guard_);
-        bool empty = output_queue_.empty();
-        if(empty)
+    if(above_high_water_)
+    {
+        switch(config_.overflow)
         {
-            // There are no messages that are ready to be sent. The actor goes to
-            // sleep by waiting on the non_empty_output_queue_ timer. When a new
-            // message is added, the timer will be modified and the actor will wake.
-            non_empty_output_queue_.expires_at(asio::steady_timer::time_point::max());
-            non_empty_output_queue_.async_wait(
-                strand_->wrap(std::bind(&asio_connection::await_output, this->shared_from_this())));
-        }
+            case high_water_policy::drop:
+                return send_status::dropped;
 
-        return empty;
-    };
+            case high_water_policy::disconnect:
+                stop(make_error_code(errc::output_queue_full));
+                return send_status::disconnected;
 
-    if(!check_if_empty())
-    {
-        start_write();
+            case high_water_policy::block:
+            {
+                // An io thread would wait for output which only the io
+                // threads write, so there the message is queued instead.
+                if(strand_->context().get_executor().running_in_this_thread())
+                {
+                    break;
+                }
+
+                std::unique_lock<std::mutex> lock(high_water_guard_);
+                drained_.wait(lock, [this]() { return stopped() || closing_ || !above_high_water_; });
+                if(stopped() || closing_)
+                {
+                    return send_status::disconnected;
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
     }
+
+    return send_status::queued;
 }
 
 template <typename socket_type>
-inline int64_t asio_connection<socket_type>::handle_read(const error_code& ec, std::size_t size)
+inline std::size_t asio_connection<socket_type>::get_lane(data_channel channel) const
 {
-    if(this->stopped())
+    auto lanes = config_.lane_weights.size();
+    if(lanes <= 1)
     {
-        return -1;
+        return 0;
     }
 
-    if(ec)
+    if(!config_.channel_lane)
     {
-        this->stop(ec);
-        return -1;
+        return lanes - 1;
     }
 
-    // NOTE! Thread safety:
+    return std::min(config_.channel_lane(channel), lanes - 1);
+}
+
+template <typename socket_type>
+inline send_status asio_connection<socket_type>::queue_msg(byte_buffer&& msg, data_channel channel,
+                                                           std::size_t lane)
+{
+    // we assume this is thread safe as it is const.
+    // Big messages are split without copying them.
+    auto frames = builder->build(std::move(msg), channel);
+    output_msg out;
+    out.frame = std::move(frames.frame);
+    out.shared = std::move(frames.split);
+    out.lane = lane;
+    return queue_output(std::move(out));
+}
+
+template <typename socket_type>
+inline send_status asio_connection<socket_type>::queue_output(output_msg&& out)
+{
+    // A sender which wakes the output actor holds it back until done here,
+    // so nothing is being written and the socket can be written right away.
+    bool direct = config_.direct_write && config_.coalesce_delay.count() == 0 && !stopped() &&
+                  !output_scheduled_.exchange(true);
+    if(direct)
+    {
+        // Messages sent before the actor was taken are written first.
+        if(pending_output_.empty())
+        {
+            write_direct(out);
+        }
+
+        if(out.empty())
+        {
+            release_output();
+
+            // A graceful stop which began meanwhile left the half close
+            // to the output actor, which this writer was holding.
+            if(closing_ && !output_scheduled_.exchange(true))
+            {
+                asio::post(*strand_, std::bind(&asio_connection::await_output, this->shared_from_this()));
+            }
+            return send_status::queued;
+        }
+    }
+
+    auto size = out.size();
+    pending_output_.push(std::move(out));
+    auto queued = queued_bytes_.fetch_add(size) + size;
+    queued_msgs_++;
+
+    // When coalescing the output actor is woken once more
+    // when enough bytes are queued to write them early.
+    bool flush = config_.coalesce_delay.count() > 0 && queued >= config_.coalesce_max_bytes &&
+                 queued - size < config_.coalesce_max_bytes;
+
+    // Wake the output actor, unless it is already awake.
+    if(direct || !output_scheduled_.exchange(true) || flush)
+    {
+        asio::post(*strand_, std::bind(&asio_connection::await_output, this->shared_from_this()));
+    }
+
+    check_high_water();
+    return above_high_water_ ? send_status::above_high_water : send_status::queued;
+}
+
+template <typename socket_type>
+inline bool asio_connection<socket_type>::over_high_water() const
+{
+    return (config_.high_water_bytes > 0 && queued_bytes_ >= config_.high_water_bytes) ||
+           (config_.high_water_msgs > 0 && queued_msgs_ >= config_.high_water_msgs);
+}
+
+template <typename socket_type>
+inline bool asio_connection<socket_type>::under_low_water() const
+{
+    return (config_.high_water_bytes == 0 || queued_bytes_ <= config_.low_water_bytes) &&
+           (config_.high_water_msgs == 0 || queued_msgs_ <= config_.low_water_msgs);
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::check_high_water()
+{
+    if(above_high_water_ || !over_high_water())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(high_water_guard_);
+        if(above_high_water_ || !over_high_water())
+        {
+            return;
+        }
+        above_high_water_ = true;
+    }
+
+    for(const auto& callback : on_high_water)
+    {
+        callback(id);
+    }
+
+    // The queue may have been written meanwhile, by a writer
+    // which did not see the flag yet.
+    check_drained();
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::check_drained()
+{
+    if(!above_high_water_ || !under_low_water())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(high_water_guard_);
+        if(!above_high_water_ || !under_low_water())
+        {
+            return;
+        }
+        above_high_water_ = false;
+    }
+    drained_.notify_all();
+
+    for(const auto& callback : on_drained)
+    {
+        callback(id);
+    }
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::await_output()
+{
+    // A write in progress continues with the new output once it completes.
+    if(stopped() || writing_)
+    {
+        return;
+    }
+
+    writing_ = prepare_output();
+    if(writing_)
+    {
+        start_write();
+    }
+    else if(closing_ && output_idle_ && !half_closed_)
+    {
+        half_closed_ = true;
+        half_close();
+    }
+}
+
+template <typename socket_type>
+inline bool asio_connection<socket_type>::prepare_output()
+{
+    output_msg out;
+    while(pending_output_.pop(out))
+    {
+        if(out.empty())
+        {
+            continue;
+        }
+
+        if(!out.shared.empty())
+        {
+            auto& lane = lanes_[out.lane];
+            auto frames = out.shared.size();
+            auto& queue = frames > 1 ? open_stream(lane) : lane.queue;
+            for(std::size_t i = 0; i < frames; ++i)
+            {
+                queue_frame(queue, out.shared[i], i + 1 == frames);
+            }
+            continue;
+        }
+
+        // The rest of a frame which is partially written
+        // goes to the wire before anything else.
+        auto& queue = out.partial ? output_queue_ : lanes_[out.lane].queue;
+        auto index = queue.size();
+        queue_frame(queue, out.frame, true);
+        queue[index].offset = out.offset;
+    }
+
+    output_idle_ = output_queue_.empty() &&
+                   std::all_of(std::begin(lanes_), std::end(lanes_), [](const output_lane& lane) {
+                       return lane.empty();
+                   });
+
+    // A heartbeat is only written when there is nothing else to write, unless
+    // it asks a silent peer for an answer. Never once closing, as the output
+    // may be shut down already.
+    if(heartbeat_due_.exchange(false) && (output_idle_ || !heard_.load(std::memory_order_relaxed)) &&
+       !closing_ && !half_closed_)
+    {
+        // on the top lane, which never waits for the output queue to drain
+        auto& queue = lanes_.front().queue;
+        queue.emplace_back();
+        queue.back().shared = heartbeat_frame_;
+        queue.back().frame_end = true;
+        queue.back().msg_end = true;
+        queued_bytes_ += heartbeat_frame_.size();
+        queued_msgs_++;
+        output_idle_ = false;
+    }
+
+    if(output_idle_)
+    {
+        // There are no messages that are ready to be sent. The actor goes to
+        // sleep until a message is sent.
+        coalesce_deadline_ = {};
+        release_output();
+        return false;
+    }
+
+    if(config_.coalesce_delay.count() > 0 && queued_bytes_ < config_.coalesce_max_bytes && !closing_)
+    {
+        auto now = asio::steady_timer::clock_type::now();
+        if(coalesce_deadline_ == asio::steady_timer::time_point{})
+        {
+            coalesce_deadline_ = now + config_.coalesce_delay;
+        }
+
+        // Hold the messages back until the delay expires
+        // or enough of them are queued.
+        if(now < coalesce_deadline_)
+        {
+            if(!coalescing_)
+            {
+                coalescing_ = true;
+                coalesce_timer_.expires_at(coalesce_deadline_);
+                coalesce_timer_.async_wait(
+                    strand_->wrap([this, sentinel = this->shared_from_this()](const error_code&) {
+                        coalescing_ = false;
+                        await_output();
+                    }));
+            }
+            return false;
+        }
+    }
+
+    coalesce_deadline_ = {};
+    commit_output();
+
+    // Write as many buffers from the front of the queue as fit in a single
+    // system call, but always at least one so that big ones are written too.
+    std::size_t bytes = 0;
+    write_buffers_count_ = 0;
+    for(const auto& msg : output_queue_)
+    {
+        auto size = msg.size() - msg.offset;
+        if(write_buffers_count_ == write_buffers_.size() ||
+           (write_buffers_count_ > 0 && bytes + size > config_.write_batch_max_bytes))
+        {
+            break;
+        }
+
+        write_buffers_[write_buffers_count_++] = asio::buffer(msg.data() + msg.offset, size);
+        bytes += size;
+    }
+
+    return true;
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::commit_output()
+{
+    // Only what the next write takes is committed, so that a frame
+    // on a higher lane waits behind a single write at most.
+    std::size_t bytes = 0;
+    for(const auto& msg : output_queue_)
+    {
+        bytes += msg.size() - msg.offset;
+    }
+
+    std::size_t lane = 0;
+    while(bytes < config_.write_batch_max_bytes && output_queue_.size() < max_write_buffers && next_lane(lane))
+    {
+        bytes += commit_frame(lanes_[lane]);
+    }
+}
+
+template <typename socket_type>
+inline std::size_t asio_connection<socket_type>::commit_frame(output_lane& lane)
+{
+    // Messages of a single frame and split messages
+    // take turns, a frame at a time.
+    bool from_streams = lane.queue.empty() || (!lane.streams.empty() && lane.streams_turn);
+    lane.streams_turn = !from_streams;
+
+    auto& queue = from_streams ? lane.streams.front() : lane.queue;
+    std::size_t bytes = 0;
+    bool frame_end = false;
+    while(!frame_end)
+    {
+        auto& msg = queue.front();
+        frame_end = msg.frame_end;
+        bytes += msg.size() - msg.offset;
+        output_queue_.emplace_back(std::move(msg));
+        queue.pop_front();
+    }
+
+    if(from_streams)
+    {
+        // The stream goes to the back of the line for its next frame.
+        auto stream = std::move(lane.streams.front());
+        lane.streams.pop_front();
+        if(!stream.empty())
+        {
+            lane.streams.emplace_back(std::move(stream));
+            return bytes;
+        }
+
+        // The stream is complete once its last frame is written, before
+        // the first frame of any held one, so the next can be opened.
+        open_streams_--;
+        auto held = std::find_if(std::begin(lanes_), std::end(lanes_), [](const output_lane& other) {
+            return !other.held.empty();
+        });
+        if(held != std::end(lanes_))
+        {
+            held->streams.emplace_back(std::move(held->held.front()));
+            held->held.pop_front();
+            open_streams_++;
+        }
+    }
+
+    return bytes;
+}
+
+template <typename socket_type>
+inline std::deque<output_buffer>& asio_connection<socket_type>::open_stream(output_lane& lane)
+{
+    if(open_streams_ < msg_builder::max_open_streams)
+    {
+        open_streams_++;
+        lane.streams.emplace_back();
+        return lane.streams.back();
+    }
+
+    lane.held.emplace_back();
+    return lane.held.back();
+}
+
+template <typename socket_type>
+inline bool asio_connection<socket_type>::next_lane(std::size_t& lane)
+{
+    const auto& weights = config_.lane_weights;
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        for(std::size_t i = 0; i < lanes_.size(); ++i)
+        {
+            if(lanes_[i].empty())
+            {
+                continue;
+            }
+
+            // A lane without weight has strict priority.
+            if(i >= weights.size() || weights[i] == 0)
+            {
+                lane = i;
+                return true;
+            }
+
+            if(lane_credits_[i] > 0)
+            {
+                lane_credits_[i]--;
+                lane = i;
+                return true;
+            }
+        }
+
+        // Every lane with frames used up its turn. Start a new round.
+        lane_credits_ = weights;
+    }
+
+    return false;
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::release_output()
+{
+    // A message sent right before the flag was cleared did not
+    // wake the actor, so check once more after clearing it.
+    output_scheduled_ = false;
+    if((!pending_output_.empty() || heartbeat_due_) && !output_scheduled_.exchange(true))
+    {
+        asio::post(*strand_, std::bind(&asio_connection::await_output, this->shared_from_this()));
+    }
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::write_direct(output_msg& out)
+{
+    // Shared frames are left to the output actor.
+    if(!out.shared.empty())
+    {
+        return;
+    }
+
+    std::array<asio::const_buffer, max_write_buffers> buffers{};
+    std::size_t count = 0;
+    for(const auto& buffer : out.frame)
+    {
+        if(count == buffers.size())
+        {
+            break;
+        }
+        buffers[count++] = asio::buffer(buffer);
+    }
+
+    // Whatever is not written, also because of an error,
+    // is left to the output actor which handles the error.
+    error_code ec;
+    std::size_t written = 0;
+    {
+        // Keeps the socket from being closed, and its handle reused, meanwhile.
+        std::lock_guard<std::mutex> lock(socket_guard_);
+        if(!stopped())
+        {
+            written = write_some_direct({buffers.data(), buffers.data() + count}, ec);
+        }
+    }
+    if(written > 0)
+    {
+        mark_sent();
+    }
+
+    // Drop the written buffers of the frame.
+    auto it = out.frame.begin();
+    while(it != out.frame.end() && written >= it->size())
+    {
+        written -= it->size();
+        pool_->release(std::move(*it));
+        ++it;
+    }
+    out.partial = it != out.frame.begin() || written > 0;
+    out.frame.erase(out.frame.begin(), it);
+    out.offset = written;
+}
+
+template <typename socket_type>
+inline std::size_t asio_connection<socket_type>::write_some_direct(const buffer_span<asio::const_buffer>&,
+                                                                   error_code&)
+{
+    return 0;
+}
+
+template <typename socket_type>
+inline int64_t asio_connection<socket_type>::handle_read(const error_code& ec, std::size_t size)
+{
+    if(this->stopped())
+    {
+        return -1;
+    }
+
+    if(ec)
+    {
+        this->stop(ec);
+        return -1;
+    }
+
+    mark_received();
+
+    // NOTE! Thread safety:
     // the builder should only be used for reads
     // which are already synchronized via the explicit 'strand'
 
@@ -389,15 +1410,17 @@ inline int64_t asio_connection<socket_type>::handle_read(const error_code& ec, s
     {
         // Extract the message from the builder.
         auto msg_data = this->builder->extract_msg();
-        auto& msg = msg_data.first;
+        auto& payload = msg_data.first;
         auto channel = msg_data.second;
 
-        if(!msg.empty())
+        if(!payload.empty())
         {
-            details d;
-            d.local_endpoint = get_local_endpoint();
-            d.remote_endpoint = get_remote_endpoint();
-            d.endpoint = get_endpoint();
+            // Take ownership without copying. Every subscriber
+            // gets a reference to the same immutable buffer,
+            // which goes back to the pool once all of them let go.
+            auto msg = pool_->share(std::move(payload));
+
+            const auto& d = get_details();
 
             for(const auto& callback : this->on_msg)
             {
@@ -406,15 +1429,36 @@ inline int64_t asio_connection<socket_type>::handle_read(const error_code& ec, s
         }
         else
         {
-            schedule_heartbeat();
+            // A heartbeat. It is answered unless something was written since
+            // the previous one, which the peer already took as an answer.
+            pool_->release(std::move(payload));
+            send_heartbeat_if_idle();
         }
     }
 
+    // Refuse to buffer a message bigger than allowed
+    // before anything is allocated for it.
+    auto operation = this->builder->get_next_operation();
+    if(config_.max_msg_size > 0 && operation.bytes > config_.max_msg_size && !should_stream(operation))
+    {
+        log() << "Message of " << operation.bytes << " bytes exceeds the maximum of "
+              << config_.max_msg_size << " bytes.";
+        this->stop(make_error_code(errc::msg_size_exceeded));
+        return -1;
+    }
+
     return static_cast<int64_t>(size);
 }
 
 template <typename socket_type>
-inline int64_t asio_connection<socket_type>::handle_write(const error_code& ec, std::size_t size)
+inline bool asio_connection<socket_type>::should_stream(const msg_builder::operation& operation) const
+{
+    return operation.payload && config_.stream_chunk_size > 0 && operation.bytes > config_.stream_chunk_size &&
+           !on_msg_chunk.empty();
+}
+
+template <typename socket_type>
+inline int64_t asio_connection<socket_type>::handle_stream_chunk(const error_code& ec, byte_buffer&& chunk)
 {
     if(this->stopped())
     {
@@ -427,65 +1471,127 @@ inline int64_t asio_connection<socket_type>::handle_write(const error_code& ec,
         return -1;
     }
 
-    auto left_to_processs = size;
+    mark_received();
+
+    // NOTE! Thread safety:
+    // the builder should only be used for reads
+    // which are already synchronized via the explicit 'strand'
+    auto operation = this->builder->get_next_operation();
+    auto size = chunk.size();
+
+    if(stream_offset_ == 0)
     {
-        std::lock_guard<std::mutex> lock(this->guard_);
-        while(left_to_processs > 0 && !this->output_queue_.empty())
+        for(const auto& callback : this->on_msg_chunk)
         {
-            auto& msg = this->output_queue_.front();
+            callback(this->id, stream_stage::begin, {}, operation.channel, operation.bytes);
+        }
+    }
 
-            auto buffer_sz = msg.buffer.size();
-            auto left = buffer_sz - msg.offset;
-            if(left_to_processs < left)
-            {
-                msg.offset += left_to_processs;
-                left_to_processs = 0;
-            }
-            else
-            {
-                left_to_processs -= left;
-                this->output_queue_.pop_front();
-            }
+    stream_offset_ += size;
+
+    auto msg = pool_->share(std::move(chunk));
+    for(const auto& callback : this->on_msg_chunk)
+    {
+        callback(this->id, stream_stage::chunk, msg, operation.channel, operation.bytes);
+    }
+
+    if(stream_offset_ < operation.bytes)
+    {
+        return static_cast<int64_t>(size);
+    }
+
+    stream_offset_ = 0;
+
+    // The payload was consumed here, so the builder
+    // completes the operation with an empty work buffer.
+    try
+    {
+        if(this->builder->process_operation(operation.bytes))
+        {
+            pool_->release(std::move(this->builder->extract_msg().first));
         }
     }
-    this->await_output();
+    catch(const std::exception& e)
+    {
+        log() << e.what();
+        if(this->builder->critical_error())
+        {
+            this->stop(make_error_code(errc::data_corruption));
+        }
+        return -1;
+    }
+    catch(...)
+    {
+        if(this->builder->critical_error())
+        {
+            this->stop(make_error_code(errc::data_corruption));
+        }
+        return -1;
+    }
+
+    for(const auto& callback : this->on_msg_chunk)
+    {
+        callback(this->id, stream_stage::end, {}, operation.channel, operation.bytes);
+    }
+
     return static_cast<int64_t>(size);
 }
 
 template <typename socket_type>
-inline std::vector<asio::const_buffer> asio_connection<socket_type>::get_output_buffers() const
+inline int64_t asio_connection<socket_type>::handle_write(const error_code& ec, std::size_t size)
 {
-    std::lock_guard<std::mutex> lock(this->guard_);
-    std::vector<asio::const_buffer> buffers;
-    buffers.reserve(this->output_queue_.size());
-    for(const auto& msg : this->output_queue_)
+    if(this->stopped())
     {
-        buffers.emplace_back(asio::buffer(msg.buffer.data() + msg.offset, msg.buffer.size() - msg.offset));
+        return -1;
     }
-    return buffers;
-}
 
-template <typename socket_type>
-inline void asio_connection<socket_type>::schedule_heartbeat()
-{
-    update_heartbeat_timestamp();
+    if(ec)
+    {
+        this->stop(ec);
+        return -1;
+    }
 
-    std::lock_guard<std::mutex> lock(this->guard_);
+    if(size > 0)
+    {
+        mark_sent();
+    }
 
-    using namespace std::chrono_literals;
-    heartbeat_reply_timer_.expires_after(1s);
-    heartbeat_reply_timer_.async_wait([ this, sentinel = this->shared_from_this() ](const error_code& ec) {
+    auto left_to_processs = size;
+    while(left_to_processs > 0 && !this->output_queue_.empty())
+    {
+        auto& msg = this->output_queue_.front();
 
-        if(this->stopped())
+        auto buffer_sz = msg.size();
+        auto left = buffer_sz - msg.offset;
+        if(left_to_processs < left)
         {
-            return;
+            msg.offset += left_to_processs;
+            left_to_processs = 0;
         }
-
-        if(!ec)
+        else
         {
-            this->send_heartbeat();
+            left_to_processs -= left;
+            queued_bytes_ -= buffer_sz;
+            if(msg.msg_end)
+            {
+                queued_msgs_--;
+            }
+            pool_->release(std::move(msg.buffer));
+            this->output_queue_.pop_front();
         }
-    });
+    }
+
+    check_drained();
+
+    writing_ = false;
+    this->await_output();
+    return static_cast<int64_t>(size);
+}
+
+template <typename socket_type>
+inline buffer_span<asio::const_buffer> asio_connection<socket_type>::get_output_buffers() const
+{
+    return {write_buffers_.data(), write_buffers_.data() + write_buffers_count_};
 }
 
 template <typename socket_type>
@@ -513,18 +1619,81 @@ std::string asio_connection<socket_type>::get_endpoint() const
 }
 
 template <typename socket_type>
-inline void asio_connection<socket_type>::update_heartbeat_timestamp()
+inline const connection::details& asio_connection<socket_type>::get_details()
+{
+    if(details_formatted_ && details_local_endpoint_ == local_endpoint_ &&
+       details_remote_endpoint_ == remote_endpoint_ && details_endpoint_ == endpoint_)
+    {
+        return details_;
+    }
+
+    details_.local_endpoint = get_local_endpoint();
+    details_.remote_endpoint = get_remote_endpoint();
+    details_.endpoint = get_endpoint();
+    details_local_endpoint_ = local_endpoint_;
+    details_remote_endpoint_ = remote_endpoint_;
+    details_endpoint_ = endpoint_;
+    details_formatted_ = true;
+    return details_;
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::mark_received()
 {
-    this->heartbeat_timestamp_ = asio::steady_timer::clock_type::now().time_since_epoch();
+    // Most reads find it set already, which keeps the cache line shared.
+    if(!received_.load(std::memory_order_relaxed))
+    {
+        received_.store(true, std::memory_order_relaxed);
+    }
+    if(!heard_.load(std::memory_order_relaxed))
+    {
+        heard_.store(true, std::memory_order_relaxed);
+    }
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::mark_sent()
+{
+    if(!sent_.load(std::memory_order_relaxed))
+    {
+        sent_.store(true, std::memory_order_relaxed);
+    }
 }
 
 template <typename socket_type>
 inline void asio_connection<socket_type>::send_heartbeat()
 {
-    // send heartbeat
-    this->send_msg({}, 0);
+    // The output actor queues the prebuilt frame, nothing is allocated here.
+    if(closing_ || heartbeat_due_.exchange(true))
+    {
+        return;
+    }
+
+    if(!output_scheduled_.exchange(true))
+    {
+        asio::post(*strand_, std::bind(&asio_connection::await_output, this->shared_from_this()));
+    }
+}
+
+template <typename socket_type>
+inline void asio_connection<socket_type>::send_heartbeat_if_idle()
+{
+    if(!sent_.exchange(false))
+    {
+        send_heartbeat();
+    }
+}
 
-    update_heartbeat_timestamp();
+template <typename socket_type>
+inline void asio_connection<socket_type>::send_idle_heartbeat()
+{
+    // Whatever is written serves as a heartbeat for the peer, but a peer
+    // which only answers heartbeats has to be asked while it is silent.
+    bool silent = !heard_.exchange(false);
+    if(!sent_.exchange(false) || silent)
+    {
+        send_heartbeat();
+    }
 }
 
 template <typename socket_type>
@@ -535,33 +1704,31 @@ inline void asio_connection<socket_type>::await_heartbeat()
         return;
     }
 
-    std::lock_guard<std::mutex> lock(this->guard_);
     // Wait before checking the heartbeat.
-    heartbeat_check_timer_.expires_after(heartbeat_check_interval_);
-    heartbeat_check_timer_.async_wait([ this, sentinel = this->shared_from_this() ](const error_code& ec) {
+    heartbeat_check_.wheel.schedule(heartbeat_check_, heartbeat_check_interval_);
+}
 
-        if(this->stopped())
-        {
-            return;
-        }
+template <typename socket_type>
+inline void asio_connection<socket_type>::await_idle_heartbeat()
+{
+    if(this->stopped() || closing_)
+    {
+        return;
+    }
 
-        if(!ec)
-        {
-            this->check_heartbeat();
-        }
-    });
+    // Often enough for the peer to hear from us twice per check of its own,
+    // but no more than once a second.
+    using namespace std::chrono_literals;
+    std::chrono::milliseconds interval = heartbeat_check_interval_;
+    auto idle = std::min<std::chrono::milliseconds>(1s, interval / 4);
+    heartbeat_idle_.wheel.schedule(heartbeat_idle_, idle);
 }
 
 template <typename socket_type>
 inline void asio_connection<socket_type>::check_heartbeat()
 {
-    std::chrono::steady_clock::duration timestamp{this->heartbeat_timestamp_};
-    std::chrono::steady_clock::time_point heartbeat_timestamp{timestamp};
-    auto now = asio::steady_timer::clock_type::now();
-    auto time_since_last_heartbeat =
-        std::chrono::duration_cast<std::chrono::seconds>(now - heartbeat_timestamp);
-
-    if(time_since_last_heartbeat > heartbeat_check_interval_)
+    // Nothing at all was received since the last check.
+    if(!received_.exchange(false))
     {
         this->stop(make_error_code(errc::host_unreachable));
     }
@@ -0,0 +1,338 @@
+#pragma once
+#include <netpp/error_code.h>
+
+#include <asio/io_service.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace net
+{
+//----------------------------------------------------------------------
+// A hierarchical timing wheel which drives the heartbeats of all the
+// connections of an io context with a single timer.
+//
+// Level 0 has a slot per tick. Every slot of the next level spans all the
+// slots of the previous one. An entry is kept at the lowest level whose
+// current span it expires in, and is moved down a level when the wheel
+// reaches its slot. Scheduling, cancelling and expiring an entry are O(1),
+// as is a tick with nothing expiring in it.
+//----------------------------------------------------------------------
+template <typename Clock = std::chrono::steady_clock>
+class basic_heartbeat_wheel : public asio::io_service::service
+{
+public:
+    using clock_type = Clock;
+    using duration = typename clock_type::duration;
+    using time_point = typename clock_type::time_point;
+
+    static asio::io_service::id id;
+
+    struct link
+    {
+        link* prev{};
+        link* next{};
+    };
+
+    //-----------------------------------------------------------------------------
+    /// A timeout which can be scheduled on the wheel, owned by a connection.
+    /// The callback is set once and runs on an io thread,
+    /// unless the owner is gone by the time the entry expires.
+    //-----------------------------------------------------------------------------
+    struct entry : link
+    {
+        explicit entry(basic_heartbeat_wheel& parent)
+            : wheel(parent)
+        {
+        }
+
+        ~entry()
+        {
+            wheel.cancel(*this);
+        }
+
+        entry(const entry&) = delete;
+        entry& operator=(const entry&) = delete;
+
+        basic_heartbeat_wheel& wheel;
+
+        /// kept alive while the callback runs
+        std::weak_ptr<void> owner;
+        std::function<void()> callback;
+
+        /// tick the entry expires at
+        uint64_t expiry{};
+    };
+
+    explicit basic_heartbeat_wheel(asio::io_service& context)
+        : asio::io_service::service(context)
+        , timer_(context)
+        , start_(clock_type::now())
+    {
+        for(auto& slots : levels_)
+        {
+            for(auto& slot : slots)
+            {
+                clear(slot);
+            }
+        }
+        clear(overflow_);
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Gets the wheel of the io context, creating it on first use.
+    //-----------------------------------------------------------------------------
+    static basic_heartbeat_wheel& get(asio::io_service& context)
+    {
+        return asio::use_service<basic_heartbeat_wheel>(context);
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Resolution of the wheel.
+    //-----------------------------------------------------------------------------
+    static duration get_tick()
+    {
+        return std::chrono::milliseconds(100);
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Schedules the entry to expire after 'delay', rounded up to a tick.
+    /// Reschedules it if it is already scheduled. Thread safe.
+    //-----------------------------------------------------------------------------
+    void schedule(entry& e, duration delay)
+    {
+        auto elapsed = clock_type::now() - start_;
+        auto now = uint64_t(elapsed / get_tick());
+        auto expiry = uint64_t((elapsed + std::max(delay, duration::zero()) + get_tick() - duration(1)) / get_tick());
+
+        std::lock_guard<std::mutex> lock(guard_);
+        if(e.next)
+        {
+            unlink(e);
+        }
+        else
+        {
+            if(size_ == 0)
+            {
+                // Nothing is in the slots, so the wheel can skip the ticks it missed.
+                current_ = std::max(current_, now);
+            }
+            ++size_;
+        }
+
+        e.expiry = std::max(expiry, current_ + 1);
+        insert(e);
+
+        if(!running_)
+        {
+            running_ = true;
+            await_tick();
+        }
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Cancels the entry if it is scheduled. Thread safe.
+    /// The callback may still run if the entry is already expiring.
+    //-----------------------------------------------------------------------------
+    void cancel(entry& e)
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        if(e.next)
+        {
+            unlink(e);
+            --size_;
+        }
+    }
+
+private:
+    static constexpr size_t level_bits = 6;
+    static constexpr size_t level_slots = size_t(1) << level_bits;
+    static constexpr size_t levels_count = 4;
+    using level = std::array<link, level_slots>;
+
+    void shutdown() override
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        timer_.cancel();
+        running_ = false;
+    }
+
+    static void clear(link& list)
+    {
+        list.prev = &list;
+        list.next = &list;
+    }
+
+    static void unlink(link& l)
+    {
+        l.prev->next = l.next;
+        l.next->prev = l.prev;
+        l.prev = nullptr;
+        l.next = nullptr;
+    }
+
+    static void push_back(link& list, link& l)
+    {
+        l.prev = list.prev;
+        l.next = &list;
+        list.prev->next = &l;
+        list.prev = &l;
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Puts the entry in the lowest level whose current span it expires in.
+    //-----------------------------------------------------------------------------
+    void insert(entry& e)
+    {
+        for(size_t i = 0; i < levels_count; ++i)
+        {
+            auto span_shift = level_bits * (i + 1);
+            if((e.expiry >> span_shift) == (current_ >> span_shift))
+            {
+                auto slot = (e.expiry >> (level_bits * i)) & (level_slots - 1);
+                push_back(levels_[i][slot], e);
+                return;
+            }
+        }
+
+        // Beyond the span of the top level. Looked at again when it wraps.
+        push_back(overflow_, e);
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Moves the entries of a list to where they belong now.
+    //-----------------------------------------------------------------------------
+    void cascade(link& list)
+    {
+        link moved;
+        clear(moved);
+        if(list.next != &list)
+        {
+            moved.next = list.next;
+            moved.prev = list.prev;
+            moved.next->prev = &moved;
+            moved.prev->next = &moved;
+            clear(list);
+        }
+
+        while(moved.next != &moved)
+        {
+            auto& e = static_cast<entry&>(*moved.next);
+            unlink(e);
+            insert(e);
+        }
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Moves the wheel a tick forward and takes the entries expiring at it.
+    //-----------------------------------------------------------------------------
+    void advance()
+    {
+        ++current_;
+
+        if((current_ & ((uint64_t(1) << (level_bits * levels_count)) - 1)) == 0)
+        {
+            cascade(overflow_);
+        }
+
+        for(size_t i = levels_count - 1; i > 0; --i)
+        {
+            auto shift = level_bits * i;
+            if((current_ & ((uint64_t(1) << shift) - 1)) == 0)
+            {
+                cascade(levels_[i][(current_ >> shift) & (level_slots - 1)]);
+            }
+        }
+
+        auto& slot = levels_[0][current_ & (level_slots - 1)];
+        while(slot.next != &slot)
+        {
+            auto& e = static_cast<entry&>(*slot.next);
+            unlink(e);
+            --size_;
+
+            auto owner = e.owner.lock();
+            if(owner)
+            {
+                expired_.emplace_back(std::move(owner), &e);
+            }
+        }
+    }
+
+    void await_tick()
+    {
+        timer_.expires_at(start_ + get_tick() * (current_ + 1));
+        timer_.async_wait([this](const error_code& ec) {
+            if(ec)
+            {
+                return;
+            }
+            on_tick();
+        });
+    }
+
+    void on_tick()
+    {
+        // The timer is armed again before the callbacks run, so the next tick
+        // may run on another io thread meanwhile. Each takes its own entries.
+        std::vector<std::pair<std::shared_ptr<void>, entry*>> expired;
+        {
+            std::lock_guard<std::mutex> lock(guard_);
+            auto now = uint64_t((clock_type::now() - start_) / get_tick());
+            while(current_ < now && size_ > 0)
+            {
+                advance();
+            }
+
+            std::swap(expired, expired_);
+
+            if(size_ > 0)
+            {
+                await_tick();
+            }
+            else
+            {
+                running_ = false;
+            }
+        }
+
+        for(const auto& e : expired)
+        {
+            e.second->callback();
+        }
+    }
+
+    /// guard for the slots
+    std::mutex guard_;
+
+    /// the single timer of the wheel. Only waited on while entries are scheduled.
+    asio::basic_waitable_timer<clock_type> timer_;
+    bool running_{};
+
+    /// ticks are counted from here
+    time_point start_;
+    uint64_t current_{};
+
+    /// scheduled entries
+    size_t size_{};
+
+    std::array<level, levels_count> levels_;
+    link overflow_;
+
+    /// entries expired by the current tick along with their owners.
+    /// Only accessed under guard_.
+    std::vector<std::pair<std::shared_ptr<void>, entry*>> expired_;
+};
+
+template <typename Clock>
+asio::io_service::id basic_heartbeat_wheel<Clock>::id;
+
+using heartbeat_wheel = basic_heartbeat_wheel<>;
+
+} // namespace net
@@ -134,7 +134,7 @@ inline void basic_client<protocol_type>::on_handshake_complete(const std::shared
           << " -> server::" << socket->lowest_layer().remote_endpoint() << " completed.";
 
     auto session =
-        std::make_shared<tcp_connection<socket_type>>(socket, create_builder, io_context_, heartbeat_);
+        std::make_shared<tcp_connection<socket_type>>(socket, create_builder, io_context_, heartbeat_, config);
 
     auto weak_this = weak_ptr(this->shared_from_this());
     session->on_disconnect.emplace_back([weak_this](connection::id_t, const error_code&) {
@@ -135,7 +135,7 @@ inline void basic_server<protocol_type>::on_handshake_complete(std::shared_ptr<s
           << " -> client::" << socket->lowest_layer().remote_endpoint() << " completed.";
 
     auto session =
-        std::make_shared<tcp_connection<socket_type>>(socket, create_builder, io_context_, heartbeat_);
+        std::make_shared<tcp_connection<socket_type>>(socket, create_builder, io_context_, heartbeat_, config);
     if(on_connection_ready)
     {
         on_connection_ready(session);
@@ -1,6 +1,8 @@
 #pragma once
 #include "../common/connection.hpp"
 
+#include <asio/ip/tcp.hpp>
+
 #include <chrono>
 #include <deque>
 #include <thread>
@@ -10,6 +12,49 @@ namespace net
 namespace tcp
 {
 
+#if defined(TCP_CORK)
+/// Holds back partial segments until the option is cleared.
+using cork = asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK>;
+#endif
+
+//-----------------------------------------------------------------------------
+/// Writes without blocking from outside of the strand. Only plain sockets can
+/// do that, ssl streams share their state with the reads on the strand.
+/// The socket object is not thread safe, so only its native handle is used,
+/// and the caller keeps it from being closed meanwhile.
+//-----------------------------------------------------------------------------
+template <typename socket_type>
+inline std::size_t write_some_nonblocking(socket_type&, const buffer_span<asio::const_buffer>&, error_code&)
+{
+    return 0;
+}
+
+inline std::size_t write_some_nonblocking(asio::ip::tcp::socket& socket,
+                                          const buffer_span<asio::const_buffer>& buffers, error_code& ec)
+{
+    // as many as asio passes to a single system call
+    std::array<asio::detail::socket_ops::buf, 64> bufs;
+    std::size_t count = 0;
+    for(const auto& buffer : buffers)
+    {
+        if(count == bufs.size())
+        {
+            break;
+        }
+        asio::detail::socket_ops::init_buf(bufs[count++], buffer.data(), buffer.size());
+    }
+
+    int flags = 0;
+#if defined(MSG_DONTWAIT)
+    flags |= MSG_DONTWAIT;
+#endif
+
+    // The socket is in non blocking mode as well, so this fails
+    // with would_block instead of waiting.
+    auto written = asio::detail::socket_ops::send(socket.native_handle(), bufs.data(), count, flags, ec);
+    return written > 0 ? std::size_t(written) : 0;
+}
+
 template <typename socket_type>
 class tcp_connection : public asio_connection<socket_type>
 {
@@ -24,6 +69,11 @@ public:
     //-----------------------------------------------------------------------------
     using base_type::base_type;
 
+    //-----------------------------------------------------------------------------
+    /// Starts the connection. Awaiting input and output
+    //-----------------------------------------------------------------------------
+    void start() override;
+
     //-----------------------------------------------------------------------------
     /// Starts the async read operation awaiting for data
     /// to be read from the socket.
@@ -42,17 +92,99 @@ public:
     //-----------------------------------------------------------------------------
     void start_write() override;
 
+    //-----------------------------------------------------------------------------
+    /// Callback to be called whenever data was written to the socket
+    /// or an error occured.
+    //-----------------------------------------------------------------------------
+    int64_t handle_write(const error_code& ec, std::size_t size) override;
+
+    //-----------------------------------------------------------------------------
+    /// Writes as much of the buffers as the socket accepts without blocking,
+    /// from outside of the strand. Connections which cannot do that write nothing.
+    //-----------------------------------------------------------------------------
+    std::size_t write_some_direct(const buffer_span<asio::const_buffer>& buffers, error_code& ec) override;
+
+protected:
+    //-----------------------------------------------------------------------------
+    /// Shuts down the sending side of the socket once a graceful stop drained
+    /// the output. The peer reads up to the end of the stream and closes its
+    /// side, which ends the read loop and stops the connection.
+    //-----------------------------------------------------------------------------
+    void half_close() override;
+
 private:
+    //-----------------------------------------------------------------------------
+    /// Starts an async read of whatever is available on the socket
+    /// into the bulk receive buffer.
+    //-----------------------------------------------------------------------------
+    void start_bulk_read();
+
+    //-----------------------------------------------------------------------------
+    /// Callback to be called whenever data was read into the bulk receive buffer
+    /// or an error occured. Feeds the builder with as many operations as
+    /// the received data can satisfy.
+    //-----------------------------------------------------------------------------
+    int64_t handle_bulk_read(const error_code& ec, std::size_t size);
+
+    //-----------------------------------------------------------------------------
+    /// Starts an async read of the next chunk of a streamed payload.
+    //-----------------------------------------------------------------------------
+    void start_stream_read(const msg_builder::operation& operation);
+
+    //-----------------------------------------------------------------------------
+    /// Callback to be called whenever a chunk of a streamed payload
+    /// was read or an error occured.
+    //-----------------------------------------------------------------------------
+    int64_t handle_stream_read(const error_code& ec, std::size_t size);
+
+    /// receive buffer used in bulk read mode
+    byte_buffer bulk_buffer_;
+
+    /// bytes of the current builder operation already
+    /// copied into the work buffer in bulk read mode
+    std::size_t bulk_op_progress_{};
+
+    /// chunk of a streamed payload being read
+    byte_buffer stream_chunk_;
+
+    /// whether the socket is corked while coalescing
+    bool corked_{};
 };
 
+template <typename socket_type>
+inline void tcp_connection<socket_type>::start()
+{
+    if(this->config_.coalesce_delay.count() > 0)
+    {
+        // Messages are coalesced here, so there is no need
+        // for the kernel to delay them any further.
+        error_code ec;
+        this->socket_->lowest_layer().set_option(asio::ip::tcp::no_delay(true), ec);
+    }
+
+    base_type::start();
+}
+
 template <typename socket_type>
 inline void tcp_connection<socket_type>::start_read()
 {
+    if(this->config_.bulk_read)
+    {
+        start_bulk_read();
+        return;
+    }
+
     // NOTE! Thread safety:
     // the builder should only be used for reads
     // which are already synchronized via the explicit 'strand'
 
     auto operation = this->builder->get_next_operation();
+    if(this->should_stream(operation))
+    {
+        start_stream_read(operation);
+        return;
+    }
+
     auto& work_buffer = this->builder->get_work_buffer();
     auto offset = work_buffer.size();
     work_buffer.resize(offset + operation.bytes);
@@ -80,9 +212,145 @@ inline int64_t tcp_connection<socket_type>::handle_read(const error_code& ec, st
     return processed;
 }
 
+template <typename socket_type>
+inline void tcp_connection<socket_type>::start_bulk_read()
+{
+    if(bulk_buffer_.empty())
+    {
+        bulk_buffer_.resize(std::max<std::size_t>(this->config_.bulk_read_buffer_size, 1));
+    }
+
+    auto shared_this = std::static_pointer_cast<tcp_connection>(this->shared_from_this());
+
+    // Here std::bind + shared_from_this is used because of the composite op async_*
+    // We want it to operate on valid data until the handler is called.
+    // Start an asynchronous operation to read whatever is available.
+    this->socket_->async_read_some(asio::buffer(bulk_buffer_),
+                                   this->strand_->wrap(std::bind(&tcp_connection::handle_bulk_read,
+                                                                 std::move(shared_this), std::placeholders::_1,
+                                                                 std::placeholders::_2)));
+}
+
+template <typename socket_type>
+inline int64_t tcp_connection<socket_type>::handle_bulk_read(const error_code& ec, std::size_t size)
+{
+    if(this->stopped())
+    {
+        return -1;
+    }
+
+    if(ec)
+    {
+        this->stop(ec);
+        return -1;
+    }
+
+    // NOTE! Thread safety:
+    // the builder should only be used for reads
+    // which are already synchronized via the explicit 'strand'
+    std::size_t processed = 0;
+    while(true)
+    {
+        auto operation = this->builder->get_next_operation();
+
+        // Zero sized operations are completed right away
+        // even if there is nothing left in the buffer.
+        auto left = size - processed;
+        if(left == 0 && operation.bytes > 0)
+        {
+            break;
+        }
+
+        if(this->should_stream(operation))
+        {
+            auto chunk_size = std::min({left, operation.bytes - this->stream_offset_,
+                                        this->config_.stream_chunk_size});
+            auto chunk = this->pool_->acquire(chunk_size);
+            std::memcpy(chunk.data(), bulk_buffer_.data() + processed, chunk_size);
+            processed += chunk_size;
+
+            if(this->handle_stream_chunk(ec, std::move(chunk)) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        auto& work_buffer = this->builder->get_work_buffer();
+        auto needed = operation.bytes - bulk_op_progress_;
+        auto chunk = std::min(needed, left);
+        if(chunk > 0)
+        {
+            // The work buffer grows as partial data arrives. Anything beyond
+            // the current operation's progress belongs to previous operations.
+            auto offset = work_buffer.size();
+            work_buffer.resize(offset + chunk);
+            std::memcpy(work_buffer.data() + offset, bulk_buffer_.data() + processed, chunk);
+            processed += chunk;
+            bulk_op_progress_ += chunk;
+        }
+
+        if(bulk_op_progress_ < operation.bytes)
+        {
+            break;
+        }
+
+        bulk_op_progress_ = 0;
+        if(base_type::handle_read(ec, operation.bytes) < 0)
+        {
+            return -1;
+        }
+    }
+
+    start_read();
+    return static_cast<int64_t>(processed);
+}
+
+template <typename socket_type>
+inline void tcp_connection<socket_type>::start_stream_read(const msg_builder::operation& operation)
+{
+    auto size = std::min(operation.bytes - this->stream_offset_, this->config_.stream_chunk_size);
+    stream_chunk_ = this->pool_->acquire(size);
+
+    auto shared_this = std::static_pointer_cast<tcp_connection>(this->shared_from_this());
+
+    // Here std::bind + shared_from_this is used because of the composite op async_*
+    // We want it to operate on valid data until the handler is called.
+    // Start an asynchronous operation to read the next chunk.
+    asio::async_read(*this->socket_, asio::buffer(stream_chunk_), asio::transfer_exactly(size),
+                     this->strand_->wrap(std::bind(&tcp_connection::handle_stream_read, std::move(shared_this),
+                                                   std::placeholders::_1, std::placeholders::_2)));
+}
+
+template <typename socket_type>
+inline int64_t tcp_connection<socket_type>::handle_stream_read(const error_code& ec, std::size_t size)
+{
+    stream_chunk_.resize(size);
+    auto processed = this->handle_stream_chunk(ec, std::move(stream_chunk_));
+
+    if(processed < 0)
+    {
+        return processed;
+    }
+
+    start_read();
+    return processed;
+}
+
 template <typename socket_type>
 inline void tcp_connection<socket_type>::start_write()
 {
+#if defined(TCP_CORK)
+    // Keep the socket corked while writing back to back batches
+    // so that the kernel sends them in full segments.
+    if(this->config_.coalesce_delay.count() > 0 && !corked_)
+    {
+        error_code ec;
+        this->socket_->lowest_layer().set_option(cork(true), ec);
+        corked_ = !ec;
+    }
+#endif
+
     // Here std::bind + shared_from_this is used because of the composite op async_*
     // We want it to operate on valid data until the handler is called.
     // Start an asynchronous operation to send all messages.
@@ -91,5 +359,45 @@ inline void tcp_connection<socket_type>::start_write()
                                                     std::placeholders::_1, std::placeholders::_2)));
 }
 
+template <typename socket_type>
+inline int64_t tcp_connection<socket_type>::handle_write(const error_code& ec, std::size_t size)
+{
+    auto processed = base_type::handle_write(ec, size);
+
+#if defined(TCP_CORK)
+    // Uncorking sends whatever partial segment is left
+    // once everything queued has been written.
+    if(processed >= 0 && corked_ && this->output_idle_)
+    {
+        error_code cork_ec;
+        this->socket_->lowest_layer().set_option(cork(false), cork_ec);
+        corked_ = !!cork_ec;
+    }
+#endif
+
+    return processed;
+}
+
+template <typename socket_type>
+inline void tcp_connection<socket_type>::half_close()
+{
+    error_code ec;
+    {
+        std::lock_guard<std::mutex> lock(this->socket_guard_);
+        this->socket_->lowest_layer().shutdown(asio::socket_base::shutdown_send, ec);
+    }
+    if(ec)
+    {
+        this->stop(this->close_error_);
+    }
+}
+
+template <typename socket_type>
+inline std::size_t tcp_connection<socket_type>::write_some_direct(const buffer_span<asio::const_buffer>& buffers,
+                                                                  error_code& ec)
+{
+    return write_some_nonblocking(*this->socket_, buffers, ec);
+}
+
 } // namespace tcp
 } // namespace net
@@ -97,7 +97,7 @@ void basic_client::start()
     }
 
     auto session =
-        std::make_shared<udp_connection>(std::move(socket), create_builder, io_context_, heartbeat_);
+        std::make_shared<udp_connection>(std::move(socket), create_builder, io_context_, heartbeat_, config);
     session->set_endpoint(endpoint_);
 
     if(on_connection_ready)
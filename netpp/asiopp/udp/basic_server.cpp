@@ -100,7 +100,7 @@ basic_server::on_handshake_complete(const std::shared_ptr<udp::socket>& socket)
     if(it == std::end(connections_))
     {
         auto session =
-            std::make_shared<udp_server_connection>(socket, create_builder, io_context_, heartbeat_);
+            std::make_shared<udp_server_connection>(socket, create_builder, io_context_, heartbeat_, config);
         session->set_endpoint(remote_endpoint_);
         session->set_strand(strand_);
 
@@ -0,0 +1,54 @@
+#include "checksum_stage.h"
+#include <netpp/crc32c.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace net
+{
+
+checksum_stage::checksum_stage(std::vector<data_channel> channels)
+	: channels_(std::move(channels))
+{
+}
+
+void checksum_stage::encode(std::vector<byte_buffer>& parts, data_channel channel) const
+{
+	(void)channel;
+
+	checksum_t crc = 0;
+	for(const auto& part : parts)
+	{
+		crc = utils::crc32c(part.data(), part.size(), crc);
+	}
+
+	parts.emplace_back(acquire_buffer(sizeof(checksum_t)));
+	utils::to_bytes(crc, parts.back().data());
+}
+
+void checksum_stage::decode(byte_buffer& payload, data_channel channel)
+{
+	(void)channel;
+
+	if(payload.size() < sizeof(checksum_t))
+	{
+		throw std::runtime_error("Invalid checksum");
+	}
+
+	auto size = payload.size() - sizeof(checksum_t);
+	checksum_t crc = 0;
+	utils::from_bytes(crc, payload.data() + size);
+	if(crc != utils::crc32c(payload.data(), size))
+	{
+		throw std::runtime_error("Checksum mismatch");
+	}
+
+	payload.resize(size);
+}
+
+bool checksum_stage::is_enabled(data_channel channel) const
+{
+	return channels_.empty() || std::find(channels_.begin(), channels_.end(), channel) != channels_.end();
+}
+
+} // namespace net
@@ -0,0 +1,34 @@
+#pragma once
+#include "pipeline_builder.h"
+
+#include <vector>
+
+namespace net
+{
+
+// Format
+// n bytes = payload
+// 4 bytes = CRC32C of the payload
+
+class checksum_stage : public msg_stage
+{
+public:
+	using checksum_t = uint32_t;
+
+	//-----------------------------------------------------------------------------
+	/// 'channels' - channels on which payloads are checksummed.
+	/// Empty means all of them. Should be the same on both sides.
+	//-----------------------------------------------------------------------------
+	explicit checksum_stage(std::vector<data_channel> channels = {});
+
+	void encode(std::vector<byte_buffer>& parts, data_channel channel) const final;
+
+	void decode(byte_buffer& payload, data_channel channel) final;
+
+	bool is_enabled(data_channel channel) const final;
+
+private:
+	std::vector<data_channel> channels_;
+};
+
+} // namespace net
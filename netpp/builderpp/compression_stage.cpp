@@ -0,0 +1,194 @@
+#include "compression_stage.h"
+
+#if defined(NETPP_WITH_ZLIB)
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include <zlib.h>
+
+namespace net
+{
+namespace
+{
+constexpr compression_stage::method_t method_none = 0;
+constexpr compression_stage::method_t method_zlib = 1;
+constexpr size_t compressed_trailer_size =
+	sizeof(compression_stage::payload_size_t) + sizeof(compression_stage::method_t);
+
+// Deflate cannot expand data more than this many times.
+constexpr size_t max_deflate_ratio = 1032;
+} // namespace
+
+compression_stage::compression_stage(compression_options options)
+	: options_(std::move(options))
+	, deflate_(std::make_unique<z_stream>())
+	, inflate_(std::make_unique<z_stream>())
+{
+	// The streams are created once and reset for every message,
+	// as initializing them allocates their internal state.
+	if(deflateInit(deflate_.get(), options_.level) != Z_OK)
+	{
+		throw std::runtime_error("Failed to initialize zlib deflate");
+	}
+
+	if(inflateInit(inflate_.get()) != Z_OK)
+	{
+		deflateEnd(deflate_.get());
+		throw std::runtime_error("Failed to initialize zlib inflate");
+	}
+}
+
+compression_stage::~compression_stage()
+{
+	deflateEnd(deflate_.get());
+	inflateEnd(inflate_.get());
+}
+
+void compression_stage::encode(std::vector<byte_buffer>& parts, data_channel channel) const
+{
+	(void)channel;
+
+	size_t size = 0;
+	for(const auto& part : parts)
+	{
+		size += part.size();
+	}
+
+	if(size >= options_.threshold)
+	{
+		auto compressed = compress(parts, size);
+		if(!compressed.empty())
+		{
+			for(auto& part : parts)
+			{
+				release_buffer(std::move(part));
+			}
+			parts.clear();
+			parts.emplace_back(std::move(compressed));
+			return;
+		}
+	}
+
+	parts.emplace_back(acquire_buffer(sizeof(method_t)));
+	parts.back().front() = method_none;
+}
+
+void compression_stage::decode(byte_buffer& payload, data_channel channel)
+{
+	(void)channel;
+
+	if(payload.empty())
+	{
+		throw std::runtime_error("Invalid compressed payload");
+	}
+
+	auto method = payload.back();
+	switch(method)
+	{
+		case method_none:
+			payload.pop_back();
+			break;
+
+		case method_zlib:
+		{
+			auto decompressed = decompress(payload);
+			release_buffer(std::move(payload));
+			payload = std::move(decompressed);
+		}
+		break;
+
+		default:
+			throw std::runtime_error("Unknown compression method");
+	}
+}
+
+bool compression_stage::is_enabled(data_channel channel) const
+{
+	return options_.channels.empty() ||
+		   std::find(options_.channels.begin(), options_.channels.end(), channel) != options_.channels.end();
+}
+
+byte_buffer compression_stage::compress(const std::vector<byte_buffer>& parts, size_t size) const
+{
+	if(size > std::numeric_limits<payload_size_t>::max())
+	{
+		return {};
+	}
+
+	std::lock_guard<std::mutex> lock(deflate_guard_);
+	auto& stream = *deflate_;
+	auto bound = deflateBound(&stream, uLong(size));
+	auto compressed = acquire_buffer(bound + compressed_trailer_size);
+
+	deflateReset(&stream);
+	stream.next_out = compressed.data();
+	stream.avail_out = uInt(bound);
+
+	// The parts are consumed one after the other without joining them.
+	int result = Z_OK;
+	for(size_t i = 0; i < parts.size(); ++i)
+	{
+		stream.next_in = const_cast<uint8_t*>(parts[i].data());
+		stream.avail_in = uInt(parts[i].size());
+		result = deflate(&stream, i + 1 == parts.size() ? Z_FINISH : Z_NO_FLUSH);
+	}
+
+	if(result != Z_STREAM_END || stream.total_out + compressed_trailer_size >= size + sizeof(method_t))
+	{
+		// Not worth it, send it as it is.
+		release_buffer(std::move(compressed));
+		return {};
+	}
+
+	size_t offset = stream.total_out;
+	offset += utils::to_bytes(payload_size_t(size), compressed.data() + offset);
+	offset += utils::to_bytes(method_zlib, compressed.data() + offset);
+	compressed.resize(offset);
+	return compressed;
+}
+
+byte_buffer compression_stage::decompress(const byte_buffer& payload)
+{
+	if(payload.size() < compressed_trailer_size)
+	{
+		throw std::runtime_error("Invalid compressed payload");
+	}
+
+	auto compressed_size = payload.size() - compressed_trailer_size;
+	payload_size_t size = 0;
+	utils::from_bytes(size, payload.data() + compressed_size);
+	// The size is checked before anything is allocated for it,
+	// as a peer could claim any size in a small payload.
+	auto max_size = options_.max_decompressed_size > 0 ? options_.max_decompressed_size : max_msg_size_;
+	if(max_size > 0 && size > max_size)
+	{
+		throw std::runtime_error("Decompressed payload exceeds the maximum allowed size");
+	}
+
+	if(size > compressed_size * max_deflate_ratio)
+	{
+		throw std::runtime_error("Invalid compressed payload");
+	}
+
+	auto decompressed = acquire_buffer(size);
+
+	auto& stream = *inflate_;
+	inflateReset(&stream);
+	stream.next_in = const_cast<uint8_t*>(payload.data());
+	stream.avail_in = uInt(compressed_size);
+	stream.next_out = decompressed.data();
+	stream.avail_out = uInt(size);
+
+	if(inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.total_out != size)
+	{
+		release_buffer(std::move(decompressed));
+		throw std::runtime_error("Invalid compressed payload");
+	}
+
+	return decompressed;
+}
+
+} // namespace net
+
+#endif
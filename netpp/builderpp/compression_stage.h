@@ -0,0 +1,67 @@
+#pragma once
+#include "pipeline_builder.h"
+
+#include <mutex>
+#include <vector>
+
+#if defined(NETPP_WITH_ZLIB)
+
+struct z_stream_s;
+
+namespace net
+{
+
+struct compression_options
+{
+	/// Payloads smaller than this are sent as they are.
+	size_t threshold = 256;
+
+	/// zlib compression level (0 - 9), -1 for the zlib default.
+	int level = -1;
+
+	/// Channels on which payloads are compressed. Empty means all of them.
+	/// Should be the same on both sides.
+	std::vector<data_channel> channels;
+
+	/// Received payloads which would decompress to more than this
+	/// are treated as data corruption. 0 means the maximum message size
+	/// of the builder, which may be no limit.
+	size_t max_decompressed_size = 0;
+};
+
+// Format
+// n bytes = payload, deflated when the method is 1
+// 4 bytes = size of the original payload, only when the method is 1
+// 1 byte  = method : 0 - none, 1 - zlib
+
+class compression_stage : public msg_stage
+{
+public:
+	using method_t = uint8_t;
+	using payload_size_t = uint32_t;
+
+	explicit compression_stage(compression_options options = {});
+	~compression_stage() override;
+
+	void encode(std::vector<byte_buffer>& parts, data_channel channel) const final;
+
+	void decode(byte_buffer& payload, data_channel channel) final;
+
+	bool is_enabled(data_channel channel) const final;
+
+private:
+	byte_buffer compress(const std::vector<byte_buffer>& parts, size_t size) const;
+
+	byte_buffer decompress(const byte_buffer& payload);
+
+	compression_options options_;
+
+	/// encode may be called from many threads at once
+	mutable std::mutex deflate_guard_;
+	std::unique_ptr<z_stream_s> deflate_;
+	std::unique_ptr<z_stream_s> inflate_;
+};
+
+} // namespace net
+
+#endif
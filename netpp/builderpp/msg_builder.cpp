@@ -1,14 +1,30 @@
 #include "msg_builder.h"
+#include <netpp/buffer_pool.h>
+#include <netpp/crc32c.h>
 
 #include <algorithm>
+#include <atomic>
 #include <iomanip>
 #include <iterator>
+#include <limits>
+#include <stdexcept>
 #include <type_traits>
 
 namespace net
 {
+namespace
+{
+constexpr single_buffer_builder::id_t more_frames_flag = 0x8000;
+constexpr single_buffer_builder::id_t max_stream_id = 0x7fff;
+
+// Stream id of the next split message. Shared by all the builders, as the
+// frames split by one may be sent through the connections of the others.
+std::atomic<single_buffer_builder::id_t> next_stream_id{0};
+} // namespace
 
-single_buffer_builder::single_buffer_builder()
+single_buffer_builder::single_buffer_builder(bool checksum, size_t fragment_size)
+	: checksum_(checksum)
+	, fragment_size_(fragment_size)
 {
 	op_.type = op_type::read_bytes;
 	op_.bytes = sizeof(header_size_t);
@@ -20,20 +36,190 @@ size_t single_buffer_builder::get_header_size()
 	return sizeof(header_size_t) + sizeof(payload_size_t) + sizeof(channel_t) + sizeof(id_t);
 }
 
-std::vector<byte_buffer> single_buffer_builder::build(byte_buffer&& msg, data_channel channel) const
+msg_frames single_buffer_builder::build(byte_buffer&& msg, data_channel channel, bool in_place) const
 {
-	id_t id = 0;
-	std::vector<byte_buffer> buffers;
+	auto skip = in_place ? get_header_size() : 0;
+	if(msg.size() < skip)
+	{
+		throw std::runtime_error("Missing the room reserved for the header");
+	}
+
+	msg_frames frames;
+	if(fragment_size_ > 0 && msg.size() - skip > fragment_size_)
+	{
+		auto payload = share_buffer(std::move(msg)).slice(skip);
+		frames.split = build_fragments(&payload, &payload + 1, channel);
+	}
+	else if(in_place)
+	{
+		write_header(msg.data(), msg.size() - skip, channel, 0);
+
+		if(checksum_)
+		{
+			auto crc = utils::crc32c(msg.data(), msg.size());
+			msg.resize(msg.size() + sizeof(checksum_t));
+			utils::to_bytes(checksum_t(crc), msg.data() + msg.size() - sizeof(checksum_t));
+		}
+
+		frames.frame.emplace_back(std::move(msg));
+	}
+	else
+	{
+		frames.frame = build_frame(&msg, &msg + 1, channel, 0);
+	}
+	return frames;
+}
+
+msg_frames single_buffer_builder::build_parts(std::vector<byte_buffer>&& parts, data_channel channel) const
+{
+	size_t payload_size = 0;
+	for(const auto& part : parts)
+	{
+		payload_size += part.size();
+	}
+
+	msg_frames frames;
+	if(fragment_size_ > 0 && payload_size > fragment_size_)
+	{
+		std::vector<shared_buffer> payload;
+		payload.reserve(parts.size());
+		for(auto& part : parts)
+		{
+			payload.emplace_back(share_buffer(std::move(part)));
+		}
+		frames.split = build_fragments(payload.data(), payload.data() + payload.size(), channel);
+	}
+	else
+	{
+		frames.frame = build_frame(parts.data(), parts.data() + parts.size(), channel, 0);
+	}
+	return frames;
+}
+
+byte_buffer single_buffer_builder::acquire_msg_buffer(data_channel) const
+{
+	return acquire_buffer(get_header_size());
+}
+
+std::vector<std::vector<shared_buffer>> single_buffer_builder::build_fragments(const shared_buffer* begin,
+																			   const shared_buffer* end,
+																			   data_channel channel) const
+{
+	size_t payload_size = 0;
+	for(auto part = begin; part != end; ++part)
+	{
+		payload_size += part->size();
+	}
+
+	auto id = id_t(next_stream_id++ % max_stream_id + 1);
+	std::vector<std::vector<shared_buffer>> frames;
+	frames.reserve((payload_size + fragment_size_ - 1) / fragment_size_);
+
+	// Every fragment is a header followed by slices of the payload,
+	// which is not copied.
+	auto part = begin;
+	size_t part_offset = 0;
+	for(size_t offset = 0; offset < payload_size; offset += fragment_size_)
+	{
+		auto size = std::min(fragment_size_, payload_size - offset);
+		bool more = offset + size < payload_size;
+
+		std::vector<shared_buffer> frame;
+		frame.reserve(checksum_ ? 4 : 3);
+
+		auto header = acquire_buffer(get_header_size());
+		write_header(header.data(), size, channel, more ? id_t(id | more_frames_flag) : id);
+		auto crc = checksum_ ? utils::crc32c(header.data(), header.size()) : 0;
+		frame.emplace_back(share_buffer(std::move(header)));
+
+		size_t filled = 0;
+		while(filled < size)
+		{
+			if(part_offset == part->size())
+			{
+				++part;
+				part_offset = 0;
+				continue;
+			}
+
+			auto chunk = std::min(size - filled, part->size() - part_offset);
+			frame.emplace_back(part->slice(part_offset, chunk));
+			if(checksum_)
+			{
+				crc = utils::crc32c(frame.back().data(), chunk, crc);
+			}
+			filled += chunk;
+			part_offset += chunk;
+		}
+
+		if(checksum_)
+		{
+			auto trailer = acquire_buffer(sizeof(checksum_t));
+			utils::to_bytes(checksum_t(crc), trailer.data());
+			frame.emplace_back(share_buffer(std::move(trailer)));
+		}
+
+		frames.emplace_back(std::move(frame));
+	}
+
+	return frames;
+}
+
+size_t single_buffer_builder::write_header(uint8_t* dst, size_t payload_size, data_channel channel,
+										   id_t id) const
+{
+	if(payload_size > std::numeric_limits<payload_size_t>::max())
+	{
+		throw std::runtime_error("Payload is too big");
+	}
+
 	auto header_size = get_header_size();
-	auto payload_size = payload_size_t(msg.size());
-	buffers.emplace_back(header_size + payload_size);
-	auto& buffer = buffers.back();
 	size_t offset = 0;
-	offset += utils::to_bytes(header_size_t(header_size), buffer.data());
-	offset += utils::to_bytes(payload_size_t(payload_size), buffer.data() + offset);
-	offset += utils::to_bytes(channel_t(channel), buffer.data() + offset);
-	offset += utils::to_bytes(id_t(id), buffer.data() + offset);
-	std::memcpy(buffer.data() + offset, msg.data(), msg.size());
+	offset += utils::to_bytes(header_size_t(header_size), dst);
+	offset += utils::to_bytes(payload_size_t(payload_size), dst + offset);
+	offset += utils::to_bytes(channel_t(channel), dst + offset);
+	offset += utils::to_bytes(id_t(id), dst + offset);
+	return offset;
+}
+
+std::vector<byte_buffer> single_buffer_builder::build_frame(byte_buffer* begin, byte_buffer* end,
+															data_channel channel, id_t id) const
+{
+	std::vector<byte_buffer> buffers;
+	buffers.reserve(size_t(end - begin) + 2);
+	size_t payload_size = 0;
+	for(auto part = begin; part != end; ++part)
+	{
+		payload_size += part->size();
+	}
+
+	buffers.emplace_back(acquire_buffer(get_header_size()));
+	auto& header = buffers.back();
+	write_header(header.data(), payload_size, channel, id);
+
+	auto crc = checksum_ ? utils::crc32c(header.data(), header.size()) : 0;
+
+	// The payload parts are enqueued as they are right after the header
+	// and everything is written with a single gather write.
+	for(auto part = begin; part != end; ++part)
+	{
+		if(part->empty())
+		{
+			continue;
+		}
+
+		if(checksum_)
+		{
+			crc = utils::crc32c(part->data(), part->size(), crc);
+		}
+		buffers.emplace_back(std::move(*part));
+	}
+
+	if(checksum_)
+	{
+		buffers.emplace_back(acquire_buffer(sizeof(checksum_t)));
+		utils::to_bytes(checksum_t(crc), buffers.back().data());
+	}
 
 	return buffers;
 }
@@ -58,6 +244,11 @@ bool single_buffer_builder::process_operation(size_t size)
 				throw std::runtime_error("Invalid header format");
 			}
 
+			if(checksum_)
+			{
+				crc_ = utils::crc32c(msg_.data(), msg_.size());
+			}
+
 			msg_.clear();
 			set_next_operation(op_type::read_bytes, header_size - sizeof(header_size_t), state::read_header);
 		}
@@ -74,6 +265,12 @@ bool single_buffer_builder::process_operation(size_t size)
 			offset += utils::from_bytes(id, msg_.data() + offset);
 			(void)offset;
 			channel_ = channel;
+			id_ = id;
+			if(checksum_)
+			{
+				crc_ = utils::crc32c(msg_.data(), msg_.size(), crc_);
+			}
+
 			msg_.clear();
 			set_next_operation(op_type::read_bytes, payload_size, state::read_payload);
 		}
@@ -81,7 +278,31 @@ bool single_buffer_builder::process_operation(size_t size)
 
 		case state::read_payload:
 		{
-			ready = true;
+			if(checksum_)
+			{
+				// The checksum is read right after the payload, which stays in place.
+				crc_ = utils::crc32c(msg_.data(), msg_.size(), crc_);
+				set_next_operation(op_type::read_bytes, sizeof(checksum_t), state::read_checksum);
+				break;
+			}
+
+			ready = complete_frame();
+			set_next_operation(op_type::read_bytes, sizeof(header_size_t), state::read_header_size);
+		}
+		break;
+
+		case state::read_checksum:
+		{
+			auto payload_size = msg_.size() - sizeof(checksum_t);
+			checksum_t crc = 0;
+			utils::from_bytes(crc, msg_.data() + payload_size);
+			if(crc != crc_)
+			{
+				throw std::runtime_error("Checksum mismatch");
+			}
+
+			msg_.resize(payload_size);
+			ready = complete_frame();
 			set_next_operation(op_type::read_bytes, sizeof(header_size_t), state::read_header_size);
 		}
 		break;
@@ -90,6 +311,49 @@ bool single_buffer_builder::process_operation(size_t size)
 	return ready;
 }
 
+bool single_buffer_builder::complete_frame()
+{
+	if(id_ == 0)
+	{
+		return true;
+	}
+
+	// Frames starting more split messages than a sender keeps open
+	// are treated as data corruption.
+	auto stream_id = id_t(id_ & max_stream_id);
+	if(streams_.size() >= max_open_streams && streams_.find(stream_id) == streams_.end())
+	{
+		throw std::runtime_error("Too many split messages in progress");
+	}
+
+	auto& stream = streams_[stream_id];
+	if(max_msg_size_ > 0 && stream.size() + msg_.size() > max_msg_size_)
+	{
+		throw std::runtime_error("Message exceeds the maximum allowed size");
+	}
+
+	if(stream.empty())
+	{
+		stream = std::move(msg_);
+		msg_ = acquire_buffer(0);
+	}
+	else
+	{
+		stream.insert(stream.end(), msg_.begin(), msg_.end());
+		msg_.clear();
+	}
+
+	if(id_ & more_frames_flag)
+	{
+		return false;
+	}
+
+	release_buffer(std::move(msg_));
+	msg_ = std::move(stream);
+	streams_.erase(stream_id);
+	return true;
+}
+
 msg_builder::operation single_buffer_builder::get_next_operation() const
 {
 	return op_;
@@ -97,7 +361,11 @@ msg_builder::operation single_buffer_builder::get_next_operation() const
 
 std::pair<byte_buffer, data_channel> single_buffer_builder::extract_msg()
 {
-	return {std::move(msg_), channel_};
+	std::pair<byte_buffer, data_channel> result{std::move(msg_), channel_};
+
+	// Keep receiving into a recycled buffer.
+	msg_ = acquire_buffer(0);
+	return result;
 }
 
 byte_buffer& single_buffer_builder::get_work_buffer()
@@ -109,6 +377,215 @@ void single_buffer_builder::set_next_operation(msg_builder::op_type type, size_t
 {
 	op_.type = type;
 	op_.bytes = size;
+	// A checksummed payload can not be streamed
+	// as it has to be verified before it is delivered.
+	// Neither can a fragment, as it is put together with the others.
+	op_.payload = st == state::read_payload && !checksum_ && id_ == 0;
+	op_.channel = channel_;
+	state_ = st;
+}
+
+namespace
+{
+constexpr compact_buffer_builder::descriptor_t extended_header_flag = 0x80;
+constexpr compact_buffer_builder::descriptor_t max_compact_payload_size = 0x7f;
+constexpr size_t max_size_bytes = sizeof(compact_buffer_builder::payload_size_t);
+constexpr size_t max_channel_bytes = sizeof(compact_buffer_builder::channel_t);
+
+size_t get_bytes_needed(uint64_t value)
+{
+	size_t bytes = 0;
+	while(value != 0)
+	{
+		value >>= 8;
+		++bytes;
+	}
+	return bytes;
+}
+
+size_t to_varint_bytes(uint64_t value, size_t bytes, uint8_t* dst)
+{
+	for(size_t i = 0; i < bytes; ++i)
+	{
+		dst[i] = uint8_t(value >> (8 * i));
+	}
+	return bytes;
+}
+
+size_t from_varint_bytes(uint64_t& value, size_t bytes, const uint8_t* src)
+{
+	value = 0;
+	for(size_t i = 0; i < bytes; ++i)
+	{
+		value |= uint64_t(src[i]) << (8 * i);
+	}
+	return bytes;
+}
+} // namespace
+
+compact_buffer_builder::compact_buffer_builder()
+{
+	op_.type = op_type::read_bytes;
+	op_.bytes = sizeof(descriptor_t);
+	state_ = state::read_descriptor;
+}
+
+size_t compact_buffer_builder::get_header_size(size_t payload_size, data_channel channel)
+{
+	if(channel == 0 && payload_size <= max_compact_payload_size)
+	{
+		return sizeof(descriptor_t);
+	}
+
+	return sizeof(descriptor_t) + get_bytes_needed(payload_size) + get_bytes_needed(channel);
+}
+
+msg_frames compact_buffer_builder::build(byte_buffer&& msg, data_channel channel, bool) const
+{
+	msg_frames frames;
+	frames.frame = build_frame(&msg, &msg + 1, channel);
+	return frames;
+}
+
+msg_frames compact_buffer_builder::build_parts(std::vector<byte_buffer>&& parts, data_channel channel) const
+{
+	msg_frames frames;
+	frames.frame = build_frame(parts.data(), parts.data() + parts.size(), channel);
+	return frames;
+}
+
+std::vector<byte_buffer> compact_buffer_builder::build_frame(byte_buffer* begin, byte_buffer* end,
+															 data_channel channel) const
+{
+	size_t payload_size = 0;
+	for(auto part = begin; part != end; ++part)
+	{
+		payload_size += part->size();
+	}
+
+	if(payload_size > std::numeric_limits<payload_size_t>::max())
+	{
+		throw std::runtime_error("Payload is too big");
+	}
+
+	std::vector<byte_buffer> buffers;
+	buffers.reserve(size_t(end - begin) + 1);
+	buffers.emplace_back(acquire_buffer(get_header_size(payload_size, channel)));
+	auto& header = buffers.back();
+
+	if(header.size() == sizeof(descriptor_t))
+	{
+		header[0] = descriptor_t(payload_size);
+	}
+	else
+	{
+		auto size_bytes = get_bytes_needed(payload_size);
+		auto channel_bytes = get_bytes_needed(channel);
+
+		size_t offset = 0;
+		header[offset++] = descriptor_t(extended_header_flag | size_bytes | (channel_bytes << 3));
+		offset += to_varint_bytes(payload_size, size_bytes, header.data() + offset);
+		offset += to_varint_bytes(channel, channel_bytes, header.data() + offset);
+		(void)offset;
+	}
+
+	// The payload parts are enqueued as they are right after the header
+	// and everything is written with a single gather write.
+	for(auto part = begin; part != end; ++part)
+	{
+		if(!part->empty())
+		{
+			buffers.emplace_back(std::move(*part));
+		}
+	}
+
+	return buffers;
+}
+
+bool compact_buffer_builder::process_operation(size_t size)
+{
+	if(size != op_.bytes)
+	{
+		throw std::runtime_error("Read was not completed properly");
+	}
+
+	bool ready = false;
+	switch(state_)
+	{
+		case state::read_descriptor:
+		{
+			descriptor_t descriptor = msg_.front();
+			msg_.clear();
+
+			if((descriptor & extended_header_flag) == 0)
+			{
+				// The whole header is this single byte.
+				channel_ = 0;
+				set_next_operation(op_type::read_bytes, descriptor, state::read_payload);
+				break;
+			}
+
+			size_t size_bytes = descriptor & 0x07;
+			channel_bytes_ = (descriptor >> 3) & 0x0f;
+			if(size_bytes > max_size_bytes || channel_bytes_ > max_channel_bytes)
+			{
+				throw std::runtime_error("Invalid header format");
+			}
+
+			set_next_operation(op_type::read_bytes, size_bytes + channel_bytes_, state::read_header);
+		}
+		break;
+		case state::read_header:
+		{
+			uint64_t payload_size = 0;
+			uint64_t channel = 0;
+			auto size_bytes = msg_.size() - channel_bytes_;
+			size_t offset = 0;
+			offset += from_varint_bytes(payload_size, size_bytes, msg_.data());
+			offset += from_varint_bytes(channel, channel_bytes_, msg_.data() + offset);
+			(void)offset;
+			channel_ = channel;
+			msg_.clear();
+			set_next_operation(op_type::read_bytes, payload_size, state::read_payload);
+		}
+		break;
+
+		case state::read_payload:
+		{
+			ready = true;
+			set_next_operation(op_type::read_bytes, sizeof(descriptor_t), state::read_descriptor);
+		}
+		break;
+	}
+
+	return ready;
+}
+
+msg_builder::operation compact_buffer_builder::get_next_operation() const
+{
+	return op_;
+}
+
+std::pair<byte_buffer, data_channel> compact_buffer_builder::extract_msg()
+{
+	std::pair<byte_buffer, data_channel> result{std::move(msg_), channel_};
+
+	// Keep receiving into a recycled buffer.
+	msg_ = acquire_buffer(0);
+	return result;
+}
+
+byte_buffer& compact_buffer_builder::get_work_buffer()
+{
+	return msg_;
+}
+
+void compact_buffer_builder::set_next_operation(msg_builder::op_type type, size_t size, state st)
+{
+	op_.type = type;
+	op_.bytes = size;
+	op_.payload = st == state::read_payload;
+	op_.channel = channel_;
 	state_ = st;
 }
 
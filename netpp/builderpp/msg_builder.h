@@ -1,6 +1,8 @@
 #pragma once
 #include <netpp/msg_builder.h>
 
+#include <map>
+
 namespace net
 {
 
@@ -10,7 +12,16 @@ namespace net
 // 4 bytes = size of the payload(the actual message).
 // 8 bytes = data channel.
 // 2 bytes = id
+//   - bits 0-14 : stream id of a message split into several frames,
+//                 0 if the frame holds a whole message.
+//   - bit 15    : more frames of the message follow.
 // n bytes = payload
+// 4 bytes = optional CRC32C of the header and the payload.
+//           Present when the builder is created with 'checksum'
+//           which should be the same on both sides.
+//
+// Frames of a split message may be interleaved with other frames.
+// They are put back together on receive, whatever the builder was created with.
 
 class single_buffer_builder : public msg_builder
 {
@@ -19,11 +30,23 @@ public:
 	using payload_size_t = uint32_t;
 	using channel_t = uint64_t;
 	using id_t = uint16_t;
-	single_buffer_builder();
+	using checksum_t = uint32_t;
+
+	//-----------------------------------------------------------------------------
+	/// 'checksum' - append a checksum to every built message and verify it
+	/// on every received one. A mismatch is reported as a data corruption.
+	/// 'fragment_size' - build splits payloads bigger than this
+	/// into frames of at most this size. 0 never splits them.
+	//-----------------------------------------------------------------------------
+	explicit single_buffer_builder(bool checksum = false, size_t fragment_size = 0);
 
 	static size_t get_header_size();
 
-	std::vector<byte_buffer> build(byte_buffer&& msg, data_channel channel) const final;
+	msg_frames build(byte_buffer&& msg, data_channel channel, bool in_place) const final;
+
+	msg_frames build_parts(std::vector<byte_buffer>&& parts, data_channel channel) const final;
+
+	byte_buffer acquire_msg_buffer(data_channel channel) const final;
 
 	bool process_operation(size_t size) final;
 
@@ -38,15 +61,96 @@ private:
 	{
 		read_header_size,
 		read_header,
-		read_payload
+		read_payload,
+		read_checksum
 	};
 
+	//-----------------------------------------------------------------------------
+	/// Writes the header of a frame. Returns its size.
+	//-----------------------------------------------------------------------------
+	size_t write_header(uint8_t* dst, size_t payload_size, data_channel channel, id_t id) const;
+
+	std::vector<byte_buffer> build_frame(byte_buffer* begin, byte_buffer* end, data_channel channel,
+										 id_t id) const;
+
+	//-----------------------------------------------------------------------------
+	/// Splits the payload into frames of at most the fragment size,
+	/// each made of a header and slices of the payload.
+	//-----------------------------------------------------------------------------
+	std::vector<std::vector<shared_buffer>> build_fragments(const shared_buffer* begin, const shared_buffer* end,
+															data_channel channel) const;
+
+	//-----------------------------------------------------------------------------
+	/// Adds a received frame to the message it belongs to.
+	/// Returns whether the message is complete.
+	//-----------------------------------------------------------------------------
+	bool complete_frame();
+
 	void set_next_operation(op_type type, size_t size, state st);
 
 	byte_buffer msg_;
 	channel_t channel_ = 0;
+	id_t id_ = 0;
 	operation op_;
 	state state_ = state::read_header_size;
+	bool checksum_ = false;
+	checksum_t crc_ = 0;
+	size_t fragment_size_ = 0;
+
+	/// payloads of the split messages being received, by stream id
+	std::map<id_t, byte_buffer> streams_;
+};
+
+// Format
+// header 1 - 13 bytes
+// 1 byte = descriptor
+//   - high bit clear : the remaining 7 bits are the size of the payload (0 - 127)
+//                      and the data channel is 0. There is nothing else in the header.
+//   - high bit set   : bits 0-2 = count of size bytes (0 - 4)
+//                      bits 3-6 = count of data channel bytes (0 - 8)
+// 0 - 4 bytes = size of the payload(the actual message), little endian.
+// 0 - 8 bytes = data channel, little endian.
+// n bytes = payload
+
+class compact_buffer_builder : public msg_builder
+{
+public:
+	using descriptor_t = uint8_t;
+	using payload_size_t = uint32_t;
+	using channel_t = uint64_t;
+	compact_buffer_builder();
+
+	static size_t get_header_size(size_t payload_size, data_channel channel);
+
+	msg_frames build(byte_buffer&& msg, data_channel channel, bool in_place) const final;
+
+	msg_frames build_parts(std::vector<byte_buffer>&& parts, data_channel channel) const final;
+
+	bool process_operation(size_t size) final;
+
+	operation get_next_operation() const final;
+
+	std::pair<byte_buffer, data_channel> extract_msg() final;
+
+	byte_buffer& get_work_buffer() final;
+
+private:
+	enum class state
+	{
+		read_descriptor,
+		read_header,
+		read_payload
+	};
+
+	std::vector<byte_buffer> build_frame(byte_buffer* begin, byte_buffer* end, data_channel channel) const;
+
+	void set_next_operation(op_type type, size_t size, state st);
+
+	byte_buffer msg_;
+	channel_t channel_ = 0;
+	size_t channel_bytes_ = 0;
+	operation op_;
+	state state_ = state::read_descriptor;
 };
 
 } // namespace net
@@ -0,0 +1,182 @@
+#include "pipeline_builder.h"
+#include <netpp/buffer_pool.h>
+
+namespace net
+{
+
+byte_buffer msg_stage::acquire_buffer(size_t size) const
+{
+	if(pool_)
+	{
+		return pool_->acquire(size);
+	}
+
+	return byte_buffer(size);
+}
+
+void msg_stage::release_buffer(byte_buffer&& buffer) const
+{
+	if(pool_)
+	{
+		pool_->release(std::move(buffer));
+	}
+}
+
+pipeline_builder::pipeline_builder(const creator& framer, const std::vector<msg_stage::creator>& stages)
+	: framer_(framer())
+{
+	stages_.reserve(stages.size());
+	for(const auto& stage : stages)
+	{
+		stages_.emplace_back(stage());
+	}
+}
+
+msg_frames pipeline_builder::build(byte_buffer&& msg, data_channel channel, bool in_place) const
+{
+	if(!is_encoded(channel))
+	{
+		return framer_->build(std::move(msg), channel, in_place);
+	}
+
+	// Transformed payloads are never framed in place, see acquire_msg_buffer.
+	// Empty payloads are heartbeats and are left intact.
+	if(msg.empty())
+	{
+		return framer_->build(std::move(msg), channel);
+	}
+
+	std::vector<byte_buffer> parts;
+	parts.reserve(stages_.size() + 1);
+	parts.emplace_back(std::move(msg));
+	return build_parts(std::move(parts), channel);
+}
+
+msg_frames pipeline_builder::build_parts(std::vector<byte_buffer>&& parts, data_channel channel) const
+{
+	// The whole payload goes through the stages before being split into frames.
+	encode(parts, channel);
+	return framer_->build_parts(std::move(parts), channel);
+}
+
+byte_buffer pipeline_builder::acquire_msg_buffer(data_channel channel) const
+{
+	// Transformed payloads can not be framed in place.
+	if(is_encoded(channel))
+	{
+		return msg_builder::acquire_msg_buffer(channel);
+	}
+
+	return framer_->acquire_msg_buffer(channel);
+}
+
+bool pipeline_builder::is_encoded(data_channel channel) const
+{
+	for(const auto& stage : stages_)
+	{
+		if(stage->is_enabled(channel))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void pipeline_builder::encode(std::vector<byte_buffer>& parts, data_channel channel) const
+{
+	bool empty = true;
+	for(const auto& part : parts)
+	{
+		empty = empty && part.empty();
+	}
+
+	if(empty)
+	{
+		return;
+	}
+
+	for(const auto& stage : stages_)
+	{
+		if(stage->is_enabled(channel))
+		{
+			stage->encode(parts, channel);
+		}
+	}
+}
+
+bool pipeline_builder::process_operation(size_t size)
+{
+	if(!framer_->process_operation(size))
+	{
+		return false;
+	}
+
+	// Decode here rather than on extraction,
+	// so that invalid data is reported as a builder error.
+	msg_ = framer_->extract_msg();
+	auto& payload = msg_.first;
+	if(payload.empty())
+	{
+		return true;
+	}
+
+	for(auto it = stages_.rbegin(); it != stages_.rend(); ++it)
+	{
+		const auto& stage = *it;
+		if(stage->is_enabled(msg_.second))
+		{
+			stage->decode(payload, msg_.second);
+		}
+	}
+
+	return true;
+}
+
+msg_builder::operation pipeline_builder::get_next_operation() const
+{
+	auto op = framer_->get_next_operation();
+
+	// A payload going through any stage has to be received whole.
+	for(const auto& stage : stages_)
+	{
+		op.payload = op.payload && !stage->is_enabled(op.channel);
+	}
+	return op;
+}
+
+std::pair<byte_buffer, data_channel> pipeline_builder::extract_msg()
+{
+	return std::move(msg_);
+}
+
+byte_buffer& pipeline_builder::get_work_buffer()
+{
+	return framer_->get_work_buffer();
+}
+
+bool pipeline_builder::critical_error() const noexcept
+{
+	return framer_->critical_error();
+}
+
+void pipeline_builder::set_buffer_pool(buffer_pool_ptr pool)
+{
+	framer_->set_buffer_pool(pool);
+	for(const auto& stage : stages_)
+	{
+		stage->set_buffer_pool(pool);
+	}
+	msg_builder::set_buffer_pool(std::move(pool));
+}
+
+void pipeline_builder::set_max_msg_size(size_t size)
+{
+	framer_->set_max_msg_size(size);
+	for(const auto& stage : stages_)
+	{
+		stage->set_max_msg_size(size);
+	}
+	msg_builder::set_max_msg_size(size);
+}
+
+} // namespace net
@@ -0,0 +1,141 @@
+#pragma once
+#include <netpp/msg_builder.h>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace net
+{
+
+//-----------------------------------------------------------------------------
+/// A transformation of the payload stacked over a framer by pipeline_builder.
+/// e.g. compression, checksums or encryption.
+//-----------------------------------------------------------------------------
+struct msg_stage
+{
+	using creator = std::function<std::unique_ptr<msg_stage>()>;
+
+	virtual ~msg_stage() = default;
+
+	//-----------------------------------------------------------------------------
+	/// Transforms an outgoing payload given as a list of parts.
+	/// Stages should add their own data as separate parts
+	/// and replace the existing ones only when they have to.
+	/// Thread safe, may be called from any thread.
+	//-----------------------------------------------------------------------------
+	virtual void encode(std::vector<byte_buffer>& parts, data_channel channel) const = 0;
+
+	//-----------------------------------------------------------------------------
+	/// Reverts encode on a received payload.
+	/// Throws if the payload is not valid.
+	//-----------------------------------------------------------------------------
+	virtual void decode(byte_buffer& payload, data_channel channel) = 0;
+
+	//-----------------------------------------------------------------------------
+	/// Checks whether the stage transforms the payloads of this channel.
+	/// Such payloads are always received whole i.e they are never streamed.
+	//-----------------------------------------------------------------------------
+	virtual bool is_enabled(data_channel channel) const = 0;
+
+	//-----------------------------------------------------------------------------
+	/// Sets a pool to draw buffers from.
+	//-----------------------------------------------------------------------------
+	void set_buffer_pool(buffer_pool_ptr pool)
+	{
+		pool_ = std::move(pool);
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Sets the maximum size of a received payload. 0 means no limit.
+	/// Stages which expand payloads should refuse to expand them beyond it.
+	//-----------------------------------------------------------------------------
+	void set_max_msg_size(size_t size)
+	{
+		max_msg_size_ = size;
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Create a creator of any derived type.
+	/// The arguments are copied and passed to the constructor of every stage.
+	//-----------------------------------------------------------------------------
+	template <typename T, typename... Args>
+	static creator get_creator(Args... args)
+	{
+		static_assert(std::is_base_of<msg_stage, T>::value, "Only derived classes"
+															"can be created this way.");
+		return [=]() { return std::make_unique<T>(args...); };
+	}
+
+protected:
+	//-----------------------------------------------------------------------------
+	/// Gets a buffer of the specified size, recycled from the pool if there is one.
+	//-----------------------------------------------------------------------------
+	byte_buffer acquire_buffer(size_t size) const;
+
+	//-----------------------------------------------------------------------------
+	/// Returns a buffer which is no longer needed to the pool if there is one.
+	//-----------------------------------------------------------------------------
+	void release_buffer(byte_buffer&& buffer) const;
+
+	/// pool to draw buffers from. May be empty.
+	buffer_pool_ptr pool_;
+
+	/// maximum size of a received payload. 0 means no limit.
+	size_t max_msg_size_ = 0;
+};
+
+using msg_stage_ptr = std::unique_ptr<msg_stage>;
+
+//-----------------------------------------------------------------------------
+/// Stacks stages over a framer, which is any other builder.
+/// Outgoing payloads go through the stages in order before being framed
+/// and received ones through them in reverse order after being unframed.
+/// e.g.
+///   get_creator<pipeline_builder>(get_creator<compact_buffer_builder>(),
+///                                 std::vector<msg_stage::creator>{
+///                                     msg_stage::get_creator<compression_stage>(),
+///                                     msg_stage::get_creator<checksum_stage>()});
+//-----------------------------------------------------------------------------
+class pipeline_builder : public msg_builder
+{
+public:
+	pipeline_builder(const creator& framer, const std::vector<msg_stage::creator>& stages);
+
+	msg_frames build(byte_buffer&& msg, data_channel channel, bool in_place) const final;
+
+	msg_frames build_parts(std::vector<byte_buffer>&& parts, data_channel channel) const final;
+
+	byte_buffer acquire_msg_buffer(data_channel channel) const final;
+
+	bool process_operation(size_t size) final;
+
+	operation get_next_operation() const final;
+
+	std::pair<byte_buffer, data_channel> extract_msg() final;
+
+	byte_buffer& get_work_buffer() final;
+
+	bool critical_error() const noexcept final;
+
+	void set_buffer_pool(buffer_pool_ptr pool) final;
+
+	void set_max_msg_size(size_t size) final;
+
+private:
+	//-----------------------------------------------------------------------------
+	/// Runs the enabled stages over the parts of an outgoing payload.
+	//-----------------------------------------------------------------------------
+	void encode(std::vector<byte_buffer>& parts, data_channel channel) const;
+
+	//-----------------------------------------------------------------------------
+	/// Checks whether any stage transforms the payloads of this channel.
+	//-----------------------------------------------------------------------------
+	bool is_encoded(data_channel channel) const;
+
+	msg_builder_ptr framer_;
+	std::vector<msg_stage_ptr> stages_;
+	std::pair<byte_buffer, data_channel> msg_;
+};
+
+} // namespace net
@@ -0,0 +1,424 @@
+#pragma once
+#include <netpp/connection.h>
+#include <netpp/connector.h>
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace net
+{
+
+//-----------------------------------------------------------------------------
+/// Read-mostly registry of connections, split into shards by connection id.
+/// Lookups take no lock. A shard is a hash table of immutable nodes which
+/// writers link in and out under the shard's own lock, so an update copies
+/// at most the few nodes of a bucket rather than the whole shard.
+/// Unlinked nodes are freed by a later writer once no lookup can still be
+/// reading them, which lookups announce by counting themselves in the
+/// shard's current generation.
+/// An index by connector makes the per connector operations
+/// independent of the total number of connections.
+//-----------------------------------------------------------------------------
+template <typename T>
+class connection_registry
+{
+public:
+	connection_registry() = default;
+	connection_registry(const connection_registry&) = delete;
+	connection_registry& operator=(const connection_registry&) = delete;
+
+	~connection_registry()
+	{
+		for(auto& target : shards_)
+		{
+			std::unique_ptr<bucket_array> buckets(target.buckets.load());
+			for(const auto& bucket : *buckets)
+			{
+				for(auto it = bucket.load(); it;)
+				{
+					std::unique_ptr<const node> freed(it);
+					it = it->next;
+				}
+			}
+		}
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Adds a connection of the specified connector. Thread safe.
+	//-----------------------------------------------------------------------------
+	void insert(connection::id_t id, connector::id_t connector_id, const T& value)
+	{
+		auto& target = get_shard(id);
+		std::lock_guard<std::mutex> lock(target.guard);
+		reclaim(target);
+
+		auto buckets = target.buckets.load();
+		if(target.size >= buckets->size())
+		{
+			buckets = rehash(target, buckets->size() * 2);
+		}
+
+		auto& head = get_bucket(*buckets, id);
+		head = new node{id, connector_id, value, head.load()};
+		target.size++;
+
+		// The index is updated within the same critical section,
+		// so it never disagrees with the shard.
+		std::lock_guard<std::mutex> index_lock(index_guard_);
+		index_[connector_id].emplace(id, value);
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Removes a connection. Thread safe.
+	//-----------------------------------------------------------------------------
+	void erase(connection::id_t id)
+	{
+		auto& target = get_shard(id);
+		std::lock_guard<std::mutex> lock(target.guard);
+		reclaim(target);
+
+		auto& head = get_bucket(*target.buckets.load(), id);
+		auto first = head.load();
+
+		// Only the nodes ahead of the erased one are copied.
+		std::vector<const node*> ahead;
+		auto it = first;
+		while(it && it->id != id)
+		{
+			ahead.emplace_back(it);
+			it = it->next;
+		}
+		if(!it)
+		{
+			return;
+		}
+
+		auto connector_id = it->connector_id;
+		auto rest = it->next;
+		for(auto ahead_it = ahead.rbegin(); ahead_it != ahead.rend(); ++ahead_it)
+		{
+			const auto& copied = **ahead_it;
+			rest = new node{copied.id, copied.connector_id, copied.value, rest};
+		}
+		head = rest;
+		target.size--;
+
+		auto& retired = get_retired(target);
+		for(auto unlinked : ahead)
+		{
+			retired.nodes.emplace_back(unlinked);
+		}
+		retired.nodes.emplace_back(it);
+
+		std::lock_guard<std::mutex> index_lock(index_guard_);
+		unindex(connector_id, id);
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Gets a copy of a connection's value. Thread safe and lock free.
+	/// Returns false if there is no such connection.
+	//-----------------------------------------------------------------------------
+	bool find(connection::id_t id, T& value) const
+	{
+		const auto& target = get_shard(id);
+		read_guard guard(target);
+		for(auto it = get_bucket(*target.buckets.load(), id).load(); it; it = it->next)
+		{
+			if(it->id == id)
+			{
+				value = it->value;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Gets copies of the values of all connections of a connector. Thread safe.
+	//-----------------------------------------------------------------------------
+	auto get_connector(connector::id_t connector_id) const -> std::vector<T>
+	{
+		std::vector<T> values;
+
+		std::lock_guard<std::mutex> lock(index_guard_);
+		auto index_it = index_.find(connector_id);
+		if(index_it == std::end(index_))
+		{
+			return values;
+		}
+
+		values.reserve(index_it->second.size());
+		for(const auto& kvp : index_it->second)
+		{
+			values.emplace_back(kvp.second);
+		}
+		return values;
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Gets copies of the values of all connections. Thread safe.
+	//-----------------------------------------------------------------------------
+	auto get_all() const -> std::vector<T>
+	{
+		std::vector<T> values;
+		for(const auto& target : shards_)
+		{
+			read_guard guard(target);
+			for(const auto& bucket : *target.buckets.load())
+			{
+				for(auto it = bucket.load(); it; it = it->next)
+				{
+					values.emplace_back(it->value);
+				}
+			}
+		}
+		return values;
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Removes all connections and returns their values. Thread safe.
+	//-----------------------------------------------------------------------------
+	auto extract_all() -> std::vector<T>
+	{
+		std::vector<T> values;
+		for(auto& target : shards_)
+		{
+			std::lock_guard<std::mutex> lock(target.guard);
+			reclaim(target);
+
+			auto& retired = get_retired(target);
+			retired.buckets.emplace_back(target.buckets.exchange(new bucket_array(initial_buckets)));
+			target.size = 0;
+
+			std::lock_guard<std::mutex> index_lock(index_guard_);
+			for(const auto& bucket : *retired.buckets.back())
+			{
+				for(auto it = bucket.load(); it; it = it->next)
+				{
+					values.emplace_back(it->value);
+					unindex(it->connector_id, it->id);
+					retired.nodes.emplace_back(it);
+				}
+			}
+		}
+
+		return values;
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Checks whether there are no connections. Thread safe and lock free.
+	//-----------------------------------------------------------------------------
+	bool empty() const
+	{
+		for(const auto& target : shards_)
+		{
+			if(target.size > 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	struct node
+	{
+		connection::id_t id{};
+		connector::id_t connector_id{};
+		T value{};
+		const node* next{};
+	};
+
+	/// Bucket heads are loaded and stored atomically.
+	using bucket_array = std::vector<std::atomic<const node*>>;
+
+	/// nodes and buckets unlinked in a generation, which lookups counted
+	/// in it may still be reading
+	struct retired_list
+	{
+		std::vector<std::unique_ptr<const node>> nodes;
+		std::vector<std::unique_ptr<bucket_array>> buckets;
+	};
+
+	struct shard_data
+	{
+		/// lock for writers of the shard
+		std::mutex guard;
+
+		/// buckets read by the lookups. Replaced only when growing.
+		std::atomic<bucket_array*> buckets{new bucket_array(initial_buckets)};
+
+		/// connections in the shard. Only changed under the lock.
+		std::atomic<std::size_t> size{0};
+
+		/// Lookups count themselves in the current generation while reading.
+		/// Writers start a new one when they unlinked something, and free it
+		/// once the lookups counted in the generation before it are done.
+		std::atomic<std::size_t> generation{0};
+		mutable std::array<std::atomic<std::size_t>, 2> readers{};
+
+		/// what was unlinked, by generation. Only accessed under the lock.
+		std::array<retired_list, 2> retired;
+	};
+
+	//-----------------------------------------------------------------------------
+	/// Counts a lookup in the current generation of a shard while it lives.
+	//-----------------------------------------------------------------------------
+	class read_guard
+	{
+	public:
+		explicit read_guard(const shard_data& target)
+		{
+			while(true)
+			{
+				auto generation = target.generation.load();
+				readers_ = &target.readers[generation % 2];
+				readers_->fetch_add(1);
+
+				// Counted in a generation which ended meanwhile, which a
+				// writer may have already found without readers.
+				if(target.generation.load() == generation)
+				{
+					return;
+				}
+				readers_->fetch_sub(1);
+			}
+		}
+
+		~read_guard()
+		{
+			readers_->fetch_sub(1);
+		}
+
+		read_guard(const read_guard&) = delete;
+		read_guard& operator=(const read_guard&) = delete;
+
+	private:
+		std::atomic<std::size_t>* readers_{};
+	};
+
+	/// Connection ids are sequential, so they spread evenly.
+	static constexpr std::size_t shard_count = 32;
+	static constexpr std::size_t initial_buckets = 8;
+
+	static auto get_bucket(bucket_array& buckets, connection::id_t id) -> std::atomic<const node*>&
+	{
+		return buckets[(id / shard_count) % buckets.size()];
+	}
+
+	static auto get_bucket(const bucket_array& buckets, connection::id_t id) -> const std::atomic<const node*>&
+	{
+		return buckets[(id / shard_count) % buckets.size()];
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Gets the list of what is unlinked in the current generation.
+	/// Called under the shard's lock.
+	//-----------------------------------------------------------------------------
+	static auto get_retired(shard_data& target) -> retired_list&
+	{
+		return target.retired[target.generation % 2];
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Frees what was unlinked in the previous generation if the lookups
+	/// counted in it are done, and if so starts a new generation when
+	/// anything was unlinked in the current one. Writers never wait for
+	/// lookups, what can not be freed yet is left to a later writer.
+	/// Called under the shard's lock.
+	//-----------------------------------------------------------------------------
+	static void reclaim(shard_data& target)
+	{
+		auto generation = target.generation.load();
+		if(target.readers[(generation + 1) % 2] > 0)
+		{
+			return;
+		}
+
+		auto& previous = target.retired[(generation + 1) % 2];
+		previous.nodes.clear();
+		previous.buckets.clear();
+
+		// Lookups from now on can not reach what was unlinked so far.
+		const auto& current = target.retired[generation % 2];
+		if(!current.nodes.empty() || !current.buckets.empty())
+		{
+			target.generation++;
+		}
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Replaces the buckets of a shard with more of them holding all the
+	/// nodes. The nodes are copied, as lookups may still be reading the
+	/// current ones. The bucket count doubles each time, so inserts copy
+	/// each node once on average. Called under the shard's lock.
+	//-----------------------------------------------------------------------------
+	static auto rehash(shard_data& target, std::size_t count) -> bucket_array*
+	{
+		auto current = target.buckets.load();
+		auto buckets = new bucket_array(count);
+		for(const auto& bucket : *current)
+		{
+			for(auto it = bucket.load(); it; it = it->next)
+			{
+				auto& moved = get_bucket(*buckets, it->id);
+				moved = new node{it->id, it->connector_id, it->value, moved.load()};
+			}
+		}
+		target.buckets = buckets;
+
+		auto& retired = get_retired(target);
+		retired.buckets.emplace_back(current);
+		for(const auto& bucket : *current)
+		{
+			for(auto it = bucket.load(); it; it = it->next)
+			{
+				retired.nodes.emplace_back(it);
+			}
+		}
+		return buckets;
+	}
+
+	//-----------------------------------------------------------------------------
+	/// Removes a connection from the connector index. Called under index_guard_.
+	//-----------------------------------------------------------------------------
+	void unindex(connector::id_t connector_id, connection::id_t id)
+	{
+		auto index_it = index_.find(connector_id);
+		if(index_it == std::end(index_))
+		{
+			return;
+		}
+		index_it->second.erase(id);
+		if(index_it->second.empty())
+		{
+			index_.erase(index_it);
+		}
+	}
+
+	auto get_shard(connection::id_t id) -> shard_data&
+	{
+		return shards_[id % shard_count];
+	}
+
+	auto get_shard(connection::id_t id) const -> const shard_data&
+	{
+		return shards_[id % shard_count];
+	}
+
+	std::array<shard_data, shard_count> shards_;
+
+	/// lock for the connector index.
+	/// Taken after a shard's lock when both are needed.
+	mutable std::mutex index_guard_;
+
+	/// values of the connections of every connector
+	std::unordered_map<connector::id_t, std::unordered_map<connection::id_t, T>> index_;
+};
+
+} // namespace net
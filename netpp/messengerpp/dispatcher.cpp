@@ -0,0 +1,420 @@
+#include "dispatcher.h"
+#include <netpp/logging.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace net
+{
+
+struct dispatcher::pool : std::enable_shared_from_this<dispatcher::pool>
+{
+	/// callbacks of a key, run by one worker at a time
+	struct strand
+	{
+		uint64_t key{};
+		std::deque<task_t> tasks;
+
+		/// whether the strand is waiting for or being run by a worker
+		bool scheduled{};
+	};
+	using strand_ptr = std::shared_ptr<strand>;
+
+	/// strands by key, locked separately so that dispatching
+	/// different keys does not contend
+	struct strand_shard
+	{
+		std::mutex guard;
+		std::unordered_map<uint64_t, strand_ptr> strands;
+	};
+
+	/// strands scheduled on a worker. The worker takes them from the front,
+	/// the others steal them from the back.
+	struct worker
+	{
+		std::mutex guard;
+		std::deque<strand_ptr> ready;
+
+		/// signalled when a strand is queued on the worker while it is idle,
+		/// or when it should steal one queued on a busy worker
+		std::condition_variable wakeup;
+
+		/// whether the worker is out of strands. Set before it looks for one
+		/// the last time, so that a strand queued meanwhile is not missed.
+		std::atomic<bool> idle{false};
+
+		/// whether the worker was woken to steal. Guarded by 'guard'.
+		bool woken{};
+
+		std::thread thread;
+	};
+
+	/// Most callbacks of a strand run before the other strands get a turn.
+	static constexpr size_t max_batch = 32;
+	static constexpr size_t shard_count = 16;
+
+	void set_workers(size_t count);
+	void start();
+	void stop();
+	void dispatch(uint64_t key, task_t task);
+	void schedule(const strand_ptr& s);
+	void wake_idle();
+	strand_ptr take(size_t index);
+	strand_ptr find(size_t index);
+	void run(const strand_ptr& s);
+	void run_worker(size_t index);
+
+	auto get_shard(uint64_t key) -> strand_shard&
+	{
+		return shards[key % shard_count];
+	}
+
+	std::array<strand_shard, shard_count> shards;
+
+	/// lock for starting the workers
+	std::mutex start_guard;
+	std::atomic<bool> started{false};
+	size_t workers_count{};
+	std::vector<std::unique_ptr<worker>> workers;
+
+	/// workers which are out of strands
+	std::atomic<size_t> idle_count{0};
+	std::atomic<bool> stopped{false};
+
+	/// worker to schedule on from outside of the pool
+	std::atomic<size_t> next_worker{0};
+};
+
+namespace
+{
+/// the pool and index of the worker running on this thread
+thread_local const void* current_pool = nullptr;
+thread_local size_t current_worker = 0;
+
+/// the dispatcher polled on this thread
+thread_local const dispatcher* current_poll = nullptr;
+} // namespace
+
+void dispatcher::pool::set_workers(size_t count)
+{
+	std::lock_guard<std::mutex> lock(start_guard);
+	workers_count = count;
+}
+
+void dispatcher::pool::start()
+{
+	std::lock_guard<std::mutex> lock(start_guard);
+	if(started)
+	{
+		return;
+	}
+
+	auto count = workers_count > 0 ? workers_count : std::thread::hardware_concurrency();
+	count = std::max<size_t>(count, 1);
+
+	workers.reserve(count);
+	for(size_t i = 0; i < count; ++i)
+	{
+		workers.emplace_back(std::make_unique<worker>());
+	}
+
+	auto shared_this = shared_from_this();
+	for(size_t i = 0; i < count; ++i)
+	{
+		workers[i]->thread = std::thread([shared_this, i]() { shared_this->run_worker(i); });
+	}
+
+	started = true;
+}
+
+void dispatcher::pool::stop()
+{
+	stopped = true;
+
+	std::lock_guard<std::mutex> lock(start_guard);
+	for(auto& w : workers)
+	{
+		// A worker about to wait either sees the flag or gets the notification.
+		{
+			std::lock_guard<std::mutex> worker_lock(w->guard);
+		}
+		w->wakeup.notify_all();
+	}
+
+	for(auto& w : workers)
+	{
+		// A callback may release the last reference to the dispatcher's owner.
+		if(w->thread.get_id() == std::this_thread::get_id())
+		{
+			w->thread.detach();
+			continue;
+		}
+		w->thread.join();
+	}
+}
+
+void dispatcher::pool::dispatch(uint64_t key, task_t task)
+{
+	if(!started)
+	{
+		start();
+	}
+
+	strand_ptr s;
+	{
+		auto& shard = get_shard(key);
+		std::lock_guard<std::mutex> lock(shard.guard);
+		auto& entry = shard.strands[key];
+		if(!entry)
+		{
+			entry = std::make_shared<strand>();
+			entry->key = key;
+		}
+
+		entry->tasks.emplace_back(std::move(task));
+		if(entry->scheduled)
+		{
+			// The worker running it will get to the callback.
+			return;
+		}
+		entry->scheduled = true;
+		s = entry;
+	}
+
+	schedule(s);
+}
+
+void dispatcher::pool::schedule(const strand_ptr& s)
+{
+	// Workers keep what they schedule to themselves, as it is likely hot
+	// in their cache. Others spread it around.
+	auto index = current_pool == this ? current_worker : next_worker++ % workers.size();
+	auto& w = *workers[index];
+	bool idle = false;
+	{
+		std::lock_guard<std::mutex> lock(w.guard);
+		w.ready.emplace_back(s);
+		idle = w.idle;
+	}
+
+	if(idle)
+	{
+		w.wakeup.notify_one();
+	}
+	else if(idle_count > 0)
+	{
+		// The worker is busy, so one which is not steals the strand.
+		wake_idle();
+	}
+}
+
+void dispatcher::pool::wake_idle()
+{
+	for(auto& w : workers)
+	{
+		if(w->idle.exchange(false))
+		{
+			{
+				std::lock_guard<std::mutex> lock(w->guard);
+				w->woken = true;
+			}
+			w->wakeup.notify_one();
+			return;
+		}
+	}
+}
+
+dispatcher::pool::strand_ptr dispatcher::pool::take(size_t index)
+{
+	auto& self = *workers[index];
+	while(true)
+	{
+		auto s = find(index);
+		if(s || stopped)
+		{
+			return s;
+		}
+
+		// A strand queued on a busy worker after this one is counted as idle
+		// wakes it, one queued before is found by looking once more.
+		idle_count++;
+		self.idle = true;
+		s = find(index);
+		if(!s)
+		{
+			std::unique_lock<std::mutex> lock(self.guard);
+			self.wakeup.wait(lock, [&]() { return stopped || self.woken || !self.ready.empty(); });
+			self.woken = false;
+		}
+		self.idle = false;
+		idle_count--;
+
+		if(s)
+		{
+			return s;
+		}
+	}
+}
+
+dispatcher::pool::strand_ptr dispatcher::pool::find(size_t index)
+{
+	for(size_t i = 0; i < workers.size(); ++i)
+	{
+		auto& w = *workers[(index + i) % workers.size()];
+		std::lock_guard<std::mutex> lock(w.guard);
+		if(w.ready.empty())
+		{
+			continue;
+		}
+
+		strand_ptr s;
+		if(i == 0)
+		{
+			s = std::move(w.ready.front());
+			w.ready.pop_front();
+		}
+		else
+		{
+			s = std::move(w.ready.back());
+			w.ready.pop_back();
+		}
+		return s;
+	}
+
+	return nullptr;
+}
+
+void dispatcher::pool::run(const strand_ptr& s)
+{
+	auto& shard = get_shard(s->key);
+
+	std::vector<task_t> batch;
+	{
+		std::lock_guard<std::mutex> lock(shard.guard);
+		auto count = std::min(s->tasks.size(), size_t(max_batch));
+		batch.reserve(count);
+		for(size_t i = 0; i < count; ++i)
+		{
+			batch.emplace_back(std::move(s->tasks.front()));
+			s->tasks.pop_front();
+		}
+	}
+
+	for(auto& task : batch)
+	{
+		try
+		{
+			task();
+		}
+		catch(std::exception& e)
+		{
+			log() << "[net::dispatcher] Exception: " << e.what();
+		}
+		catch(...)
+		{
+			log() << "[net::dispatcher] Exception: unknown";
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(shard.guard);
+		if(s->tasks.empty())
+		{
+			// The next callback of the key makes a new strand.
+			shard.strands.erase(s->key);
+			return;
+		}
+	}
+
+	// Let the other strands have a turn before the next batch.
+	schedule(s);
+}
+
+void dispatcher::pool::run_worker(size_t index)
+{
+	current_pool = this;
+	current_worker = index;
+
+	while(auto s = take(index))
+	{
+		run(s);
+	}
+}
+
+dispatcher::dispatcher()
+	: pool_(std::make_shared<pool>())
+{
+}
+
+dispatcher::~dispatcher()
+{
+	pool_->stop();
+}
+
+void dispatcher::dispatch(dispatch_policy policy, uint64_t key, task_t task)
+{
+	switch(policy)
+	{
+		case dispatch_policy::worker_pool:
+			pool_->dispatch(key, std::move(task));
+			break;
+
+		case dispatch_policy::polled:
+			polled_.push(std::move(task));
+			break;
+
+		default:
+			task();
+			break;
+	}
+}
+
+size_t dispatcher::poll(size_t max_count)
+{
+	// A callback polling again would wait for itself, and running the
+	// callbacks after it first would break their order anyway.
+	if(current_poll == this)
+	{
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> lock(poll_guard_);
+	auto outer_poll = current_poll;
+	current_poll = this;
+
+	size_t count = 0;
+	task_t task;
+	while((max_count == 0 || count < max_count) && polled_.pop(task))
+	{
+		// Like on the workers, a throwing callback does not stop the others.
+		try
+		{
+			task();
+		}
+		catch(std::exception& e)
+		{
+			log() << "[net::dispatcher] Exception: " << e.what();
+		}
+		catch(...)
+		{
+			log() << "[net::dispatcher] Exception: unknown";
+		}
+		++count;
+	}
+
+	current_poll = outer_poll;
+	return count;
+}
+
+void dispatcher::set_workers(size_t count)
+{
+	pool_->set_workers(count);
+}
+
+} // namespace net
@@ -0,0 +1,75 @@
+#pragma once
+#include <netpp/mpsc_queue.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace net
+{
+
+/// Where the messenger calls the callbacks of a connector.
+enum class dispatch_policy
+{
+	/// on the io thread which received the event, as it happens
+	io_thread,
+	/// on the threads of the messenger's worker pool
+	worker_pool,
+	/// on the thread which calls messenger::poll
+	polled
+};
+
+//-----------------------------------------------------------------------------
+/// Runs callbacks according to a dispatch policy. Callbacks with the same key
+/// run one after another in the order they were dispatched.
+/// In the worker pool callbacks with different keys run in parallel.
+/// Every key has a queue of its own, which the workers take turns on and
+/// steal from each other when they run out of them.
+//-----------------------------------------------------------------------------
+class dispatcher
+{
+public:
+	using task_t = std::function<void()>;
+
+	dispatcher();
+	~dispatcher();
+
+	dispatcher(const dispatcher&) = delete;
+	dispatcher& operator=(const dispatcher&) = delete;
+
+	//-----------------------------------------------------------------------------
+	/// Runs a callback according to the policy. Thread safe.
+	/// 'key' - callbacks with the same key are run in order e.g a connection id.
+	//-----------------------------------------------------------------------------
+	void dispatch(dispatch_policy policy, uint64_t key, task_t task);
+
+	//-----------------------------------------------------------------------------
+	/// Runs the polled callbacks dispatched so far on the calling thread.
+	/// 'max_count' - most callbacks to run. 0 runs all of them.
+	/// Exceptions thrown by the callbacks are logged.
+	/// Does nothing when called from one of the callbacks.
+	/// Returns how many callbacks were run.
+	//-----------------------------------------------------------------------------
+	size_t poll(size_t max_count = 0);
+
+	//-----------------------------------------------------------------------------
+	/// Sets how many threads the worker pool starts with. Only has an effect
+	/// before anything is dispatched to it. 0 means one per hardware thread.
+	//-----------------------------------------------------------------------------
+	void set_workers(size_t count);
+
+private:
+	struct pool;
+
+	/// the worker pool. Shared with its threads, which may outlive the dispatcher.
+	std::shared_ptr<pool> pool_;
+
+	/// callbacks waiting for poll. Filled without locking by the io threads.
+	mpsc_queue<task_t> polled_;
+
+	/// lock for the consumer side of the polled queue
+	std::mutex poll_guard_;
+};
+
+} // namespace net
@@ -1,9 +1,13 @@
 #ifndef MESSENGER_H
 #define MESSENGER_H
 
+#include <chrono>
 #include <memory>
 #include <mutex>
 #include <map>
+#include <vector>
+#include "connection_registry.h"
+#include "dispatcher.h"
 #include <netpp/connector.h>
 
 namespace net
@@ -35,7 +39,14 @@ struct serializer
             deserializer >> msg;
             return msg;
         }
-    };)");
+    };
+    Optionally provide
+        static T from_buffer(const shared_buffer& buffer);
+    to deserialize straight from the received buffer without copying it.
+    Optionally provide
+        static void to_buffer(const T& msg, byte_buffer& buffer);
+    appending to the buffer, to serialize straight into the
+    buffer which is sent without copying it.)");
 
 	static byte_buffer to_buffer(const T&);
 	static T from_buffer(byte_buffer&&);
@@ -55,6 +66,9 @@ public:
 	using on_connect_t = std::function<void(connection::id_t)>;
 	using on_disconnect_t = std::function<void(connection::id_t, const error_code&)>;
 	using on_msg_t = std::function<void(connection::id_t, msg_t, const connection::details&)>;
+	using on_high_water_t = std::function<void(connection::id_t)>;
+	using on_drained_t = std::function<void(connection::id_t)>;
+	using msg_key_t = std::function<uint64_t(connection::id_t, const msg_t&)>;
 
 	//-----------------------------------------------------------------------------
 	/// Creates a messenger
@@ -63,8 +77,10 @@ public:
 
 	//-----------------------------------------------------------------------------
 	/// Removes all connnectors and disconnects all connections.
+	/// 'linger' - how long to wait for each connection to write what was
+	/// sent to it. 0 closes them right away. Does not wait either way.
 	//-----------------------------------------------------------------------------
-	void remove_all();
+	void remove_all(std::chrono::milliseconds linger = {});
 
 	//-----------------------------------------------------------------------------
 	/// Adds a connector to the messenger with callbacks which will be called
@@ -77,9 +93,24 @@ public:
 	/// a specific connection.
 	/// 'on_request' - callback to be triggered when a new request that expects a
 	/// response is received from a specific connection.
+	/// 'on_high_water' - callback to be triggered when the messages sent to a
+	/// connection pile up to the high watermark of the connector's config.
+	/// 'on_drained' - callback to be triggered when they drain to the low watermark.
+	/// 'dispatch' - where the callbacks are called. Unless they are called on
+	/// the io threads, the callbacks of a connection are still called one
+	/// after another in order, but slow callbacks do not hold back the io.
+	/// The worker pool calls the callbacks of different connections in parallel.
+	/// 'msg_key' - with the worker pool, orders the messages by this key
+	/// instead of by connection. Messages with different keys are processed
+	/// in parallel, even from the same connection, and are no longer ordered
+	/// with the other callbacks of their connection.
 	//-----------------------------------------------------------------------------
 	auto add_connector(connector_ptr connector, on_connect_t on_connect,
-								  on_disconnect_t on_disconnect, on_msg_t on_msg) -> connector::id_t;
+								  on_disconnect_t on_disconnect, on_msg_t on_msg,
+								  on_high_water_t on_high_water = {}, on_drained_t on_drained = {},
+								  dispatch_policy dispatch = dispatch_policy::io_thread,
+								  msg_key_t msg_key = {})
+		-> connector::id_t;
 
 	//-----------------------------------------------------------------------------
 	/// Removes a connector from messenger. Thread safe.
@@ -91,30 +122,74 @@ public:
 	/// Sends a message to the specified connection. Thread safe.
 	/// 'id' - the desired receiver of the message.
 	/// 'msg' - the user defined message.
+	/// Returns whether the message was queued, according to the
+	/// high watermark policy of the connector's config.
 	//-----------------------------------------------------------------------------
-	void send_msg(connection::id_t id, msg_t&& msg);
+	auto send_msg(connection::id_t id, msg_t&& msg) -> send_status;
+
+	//-----------------------------------------------------------------------------
+	/// Sends a message to the specified connections. Thread safe.
+	/// The message is serialized once and framed once per connector,
+	/// and all connections share the framed buffers.
+	/// 'ids' - the desired receivers of the message.
+	/// 'msg' - the user defined message.
+	/// Returns to how many connections the message was queued.
+	//-----------------------------------------------------------------------------
+	auto broadcast(const std::vector<connection::id_t>& ids, const msg_t& msg) -> size_t;
+
+	//-----------------------------------------------------------------------------
+	/// Sends a message to all connections of the specified connector,
+	/// like broadcast. Thread safe.
+	//-----------------------------------------------------------------------------
+	auto broadcast_connector(connector::id_t id, const msg_t& msg) -> size_t;
+
+	//-----------------------------------------------------------------------------
+	/// Sends a message to all connections, like broadcast. Thread safe.
+	//-----------------------------------------------------------------------------
+	auto broadcast_all(const msg_t& msg) -> size_t;
 
 	//-----------------------------------------------------------------------------
 	/// Disconnects the specified connection. Thread safe.
 	/// 'id' - the connection to be disconnected.
+	/// 'linger' - how long to wait for the connection to write what was
+	/// sent to it. 0 closes it right away. Does not wait either way.
 	//-----------------------------------------------------------------------------
 	void disconnect(connection::id_t id,
-					const error_code& err = make_error_code(errc::user_triggered_disconnect));
+					const error_code& err = make_error_code(errc::user_triggered_disconnect),
+					std::chrono::milliseconds linger = {});
 
     //-----------------------------------------------------------------------------
     /// Disconnects all connections for the specified connector. Thread safe.
     /// 'id' - the connector which connnections to be disconnected.
     ///     //-----------------------------------------------------------------------------
-    void disconnect_all(connector::id_t id, const error_code& err = {});
+    void disconnect_all(connector::id_t id, const error_code& err = {},
+                        std::chrono::milliseconds linger = {});
 
     //-----------------------------------------------------------------------------
     /// Disconnects all connections for the specified connector and removes the connector. Thread safe.
     /// 'id' - the connector to be disconnected.
     //-----------------------------------------------------------------------------
-    void remove_and_disconnect_all(connector::id_t id, const error_code& err = {});
+    void remove_and_disconnect_all(connector::id_t id, const error_code& err = {},
+                                   std::chrono::milliseconds linger = {});
 
 	auto empty() const -> bool;
 
+	//-----------------------------------------------------------------------------
+	/// Calls the callbacks of the connectors with dispatch_policy::polled
+	/// on the calling thread. Thread safe.
+	/// 'max_count' - most callbacks to call. 0 calls all which are pending.
+	/// Called from one of the callbacks it does nothing, as they are called in order.
+	/// Returns how many callbacks were called.
+	//-----------------------------------------------------------------------------
+	auto poll(size_t max_count = 0) -> size_t;
+
+	//-----------------------------------------------------------------------------
+	/// Sets how many threads call the callbacks of the connectors with
+	/// dispatch_policy::worker_pool. Only has an effect before the first
+	/// such callback. 0 means one per hardware thread.
+	//-----------------------------------------------------------------------------
+	void set_workers(size_t count);
+
 private:
 	messenger() = default;
 
@@ -123,8 +198,12 @@ private:
 		on_connect_t on_connect{};
 		on_disconnect_t on_disconnect{};
 		on_msg_t on_msg{};
+		on_high_water_t on_high_water{};
+		on_drained_t on_drained{};
+		msg_key_t msg_key{};
 
 		connector::id_t connector_id{};
+		dispatch_policy dispatch{};
 	};
 	using user_info_ptr = std::shared_ptr<user_info>;
 
@@ -132,20 +211,32 @@ private:
 	{
 		std::shared_ptr<void> sentinel;
 		connection_ptr connection;
+		connector::id_t connector_id{};
 	};
+	using details_ptr = std::shared_ptr<const connection::details>;
+
 	void on_new_connection(connection_ptr& connection, const user_info_ptr& info);
 	void on_connect(connection::id_t id, connection_info&& conn_info, const user_info_ptr& info);
 	void on_disconnect(connection::id_t id, error_code ec, const user_info_ptr& info);
-	void on_raw_msg(connection::id_t id, byte_buffer& raw_msg, data_channel channel,
-					const user_info_ptr& info, const connection::details& details);
+	void on_raw_msg(connection::id_t id, const shared_buffer& raw_msg, data_channel channel,
+					const user_info_ptr& info, const connection::details& details, details_ptr& shared_details);
 
-	void on_msg(connection::id_t id, msg_t& msg, const user_info_ptr& info, const connection::details& details);
-	void send(connection::id_t id, msg_t& msg, data_channel channel);
+	void on_msg(connection::id_t id, msg_t& msg, const user_info_ptr& info, const connection::details& details,
+				details_ptr& shared_details);
+	auto send(connection::id_t id, msg_t& msg, data_channel channel) -> send_status;
+	auto send_shared(std::vector<connection_info>& targets, const msg_t& msg, data_channel channel) -> size_t;
+	void dispatch(const user_info_ptr& info, uint64_t key, dispatcher::task_t task);
 
-	/// lock for container synchronization
+	/// lock for connectors synchronization
 	mutable std::mutex guard_;
 	std::map<connector::id_t, connector_ptr> connectors_;
-	std::map<connection::id_t, connection_info> connections_;
+
+	/// connections are looked up by every send, so they are
+	/// kept separately in a registry which does not lock for that
+	connection_registry<connection_info> connections_;
+
+	/// calls the callbacks according to the policy of their connector
+	dispatcher dispatcher_;
 };
 
 std::vector<std::function<void()>>& get_deleters();
@@ -1,6 +1,9 @@
 #pragma once
 #include "messenger.h"
+#include <algorithm>
 #include <system_error>
+#include <type_traits>
+#include <utility>
 namespace net
 {
 namespace detail
@@ -11,6 +14,72 @@ inline bool is_msg(uint64_t channel)
 	return channel == 0;
 }
 
+template <typename Serializer, typename = void>
+struct has_shared_from_buffer : std::false_type
+{
+};
+
+template <typename Serializer>
+struct has_shared_from_buffer<Serializer, decltype(void(Serializer::from_buffer(
+											  std::declval<const shared_buffer&>())))> : std::true_type
+{
+};
+
+// The serializer reads straight from the shared buffer.
+template <typename Serializer>
+auto from_buffer(const shared_buffer& buffer, std::true_type)
+{
+	return Serializer::from_buffer(buffer);
+}
+
+// The serializer needs to own a buffer. Give it a copy.
+template <typename Serializer>
+auto from_buffer(const shared_buffer& buffer, std::false_type)
+{
+	return Serializer::from_buffer(buffer.to_byte_buffer());
+}
+
+template <typename Serializer>
+auto from_buffer(const shared_buffer& buffer)
+{
+	return from_buffer<Serializer>(buffer, has_shared_from_buffer<Serializer>{});
+}
+
+template <typename Serializer, typename T, typename = void>
+struct has_append_to_buffer : std::false_type
+{
+};
+
+template <typename Serializer, typename T>
+struct has_append_to_buffer<Serializer, T, decltype(void(Serializer::to_buffer(
+											   std::declval<const T&>(), std::declval<byte_buffer&>())))>
+	: std::true_type
+{
+};
+
+// The serializer appends to the buffer reserved by the builder.
+template <typename Serializer, typename T>
+send_status send(connection& conn, const T& msg, data_channel channel, std::true_type)
+{
+	// we assume this is thread safe as it is const.
+	auto buffer = conn.builder->acquire_msg_buffer(channel);
+	Serializer::to_buffer(msg, buffer);
+	return conn.send_msg_in_place(std::move(buffer), channel);
+}
+
+// The serializer makes a buffer of its own.
+template <typename Serializer, typename T>
+send_status send(connection& conn, const T& msg, data_channel channel, std::false_type)
+{
+	return conn.send_msg(Serializer::to_buffer(msg), channel);
+}
+
+template <typename Serializer, typename T>
+send_status send(connection& conn, const T& msg, data_channel channel)
+{
+	return send<Serializer>(conn, msg, channel, has_append_to_buffer<Serializer, T>{});
+}
+
 }
 template <typename T, typename OArchive, typename IArchive>
 typename messenger<T, OArchive, IArchive>::ptr messenger<T, OArchive, IArchive>::create()
@@ -25,7 +94,11 @@ template <typename T, typename OArchive, typename IArchive>
 connector::id_t messenger<T, OArchive, IArchive>::add_connector(connector_ptr connector,
 																on_connect_t on_connect,
 																on_disconnect_t on_disconnect,
-																on_msg_t on_msg)
+																on_msg_t on_msg,
+																on_high_water_t on_high_water,
+																on_drained_t on_drained,
+																dispatch_policy dispatch,
+																msg_key_t msg_key)
 {
 	// check for connector validity
 	if(!connector)
@@ -47,8 +120,12 @@ connector::id_t messenger<T, OArchive, IArchive>::add_connector(connector_ptr co
 	info->on_connect = std::move(on_connect);
 	info->on_disconnect = std::move(on_disconnect);
 	info->on_msg = std::move(on_msg);
+	info->on_high_water = std::move(on_high_water);
+	info->on_drained = std::move(on_drained);
+	info->msg_key = std::move(msg_key);
 
 	info->connector_id = connector_id;
+	info->dispatch = dispatch;
 
 	auto weak_this = weak_ptr(this->shared_from_this());
 
@@ -77,61 +154,76 @@ connector::id_t messenger<T, OArchive, IArchive>::add_connector(connector_ptr co
 }
 
 template <typename T, typename OArchive, typename IArchive>
-void messenger<T, OArchive, IArchive>::send_msg(connection::id_t id, msg_t&& msg)
+send_status messenger<T, OArchive, IArchive>::send_msg(connection::id_t id, msg_t&& msg)
 {
 	// Standard messeges
-	send(id, msg, 0);
+	return send(id, msg, 0);
 }
 
 template <typename T, typename OArchive, typename IArchive>
-void messenger<T, OArchive, IArchive>::disconnect(connection::id_t id, const error_code& err)
+size_t messenger<T, OArchive, IArchive>::broadcast(const std::vector<connection::id_t>& ids, const msg_t& msg)
 {
-	std::unique_lock<std::mutex> lock(guard_);
-
-	auto conn_it = connections_.find(id);
-	if(conn_it == std::end(connections_))
+	std::vector<connection_info> targets;
+	targets.reserve(ids.size());
+	for(const auto id : ids)
 	{
-		return;
+		connection_info conn_info;
+		if(connections_.find(id, conn_info))
+		{
+			targets.emplace_back(std::move(conn_info));
+		}
 	}
-	auto& conn_info = conn_it->second;
 
-	// get a copy so that we can unlock
-	// and work on unlocked mutex
-	// after the unlock we may be the last
-	// user of this connection.
-	auto connection = conn_info.connection;
+	return send_shared(targets, msg, 0);
+}
+
+template <typename T, typename OArchive, typename IArchive>
+size_t messenger<T, OArchive, IArchive>::broadcast_connector(connector::id_t id, const msg_t& msg)
+{
+	auto targets = connections_.get_connector(id);
+	return send_shared(targets, msg, 0);
+}
+
+template <typename T, typename OArchive, typename IArchive>
+size_t messenger<T, OArchive, IArchive>::broadcast_all(const msg_t& msg)
+{
+	auto targets = connections_.get_all();
+	return send_shared(targets, msg, 0);
+}
 
-	lock.unlock();
+template <typename T, typename OArchive, typename IArchive>
+void messenger<T, OArchive, IArchive>::disconnect(connection::id_t id, const error_code& err,
+												 std::chrono::milliseconds linger)
+{
+	// get a copy as after it is removed
+	// we may be the last user of this connection.
+	connection_info conn_info;
+	if(!connections_.find(id, conn_info))
+	{
+		return;
+	}
 
-	connection->stop(err);
+	conn_info.connection->stop_gracefully(err, linger);
 }
 
 template <typename T, typename OArchive, typename IArchive>
-void messenger<T, OArchive, IArchive>::remove_and_disconnect_all(connector::id_t id, const error_code& err)
+void messenger<T, OArchive, IArchive>::remove_and_disconnect_all(connector::id_t id, const error_code& err,
+                                                                 std::chrono::milliseconds linger)
 {
     remove_connector(id);
-    disconnect_all(id, err);
+    disconnect_all(id, err, linger);
 }
 
 template <typename T, typename OArchive, typename IArchive>
-void messenger<T, OArchive, IArchive>::disconnect_all(connector::id_t id, const error_code& err)
+void messenger<T, OArchive, IArchive>::disconnect_all(connector::id_t id, const error_code& err,
+                                                      std::chrono::milliseconds linger)
 {
-    std::vector<connection::id_t> connections_to_disconnect;
-
-    {
-        std::unique_lock<std::mutex> lock(guard_);
-        for(const auto& kvp : connections_)
-        {
-            if(kvp.second.connector_id == id)
-            {
-                connections_to_disconnect.emplace_back(kvp.first);
-            }
-        }
-    }
+    auto connections_to_disconnect = connections_.get_connector(id);
 
-    for(const auto id : connections_to_disconnect)
+    // Stopping does not wait, so the connections close in parallel on their io threads.
+    for(const auto& conn_info : connections_to_disconnect)
     {
-        disconnect(id, err);
+        conn_info.connection->stop_gracefully(err, linger);
     }
 }
 
@@ -145,25 +237,42 @@ void messenger<T, OArchive, IArchive>::remove_connector(connector::id_t id)
 template <typename T, typename OArchive, typename IArchive>
 bool messenger<T, OArchive, IArchive>::empty() const
 {
-	std::lock_guard<std::mutex> lock(guard_);
-	return connectors_.empty() && connections_.empty();
+	{
+		std::lock_guard<std::mutex> lock(guard_);
+		if(!connectors_.empty())
+		{
+			return false;
+		}
+	}
+	return connections_.empty();
+}
+
+template <typename T, typename OArchive, typename IArchive>
+size_t messenger<T, OArchive, IArchive>::poll(size_t max_count)
+{
+	return dispatcher_.poll(max_count);
 }
 
 template <typename T, typename OArchive, typename IArchive>
-void messenger<T, OArchive, IArchive>::remove_all()
+void messenger<T, OArchive, IArchive>::set_workers(size_t count)
 {
-	auto connections = [&]() {
+	dispatcher_.set_workers(count);
+}
+
+template <typename T, typename OArchive, typename IArchive>
+void messenger<T, OArchive, IArchive>::remove_all(std::chrono::milliseconds linger)
+{
+	{
 		std::lock_guard<std::mutex> lock(guard_);
 		connectors_.clear();
-		return std::move(connections_);
-	}();
+	}
+	auto connections = connections_.extract_all();
 
 	// safely iterate the extracted connections
-	for(auto& kvp : connections)
+	for(auto& conn_info : connections)
 	{
-		auto& conn_info = kvp.second;
 		auto& connection = conn_info.connection;
-		connection->stop({});
+		connection->stop_gracefully({}, linger);
 		connection.reset();
 	}
 }
@@ -176,6 +285,7 @@ void messenger<T, OArchive, IArchive>::on_new_connection(connection_ptr& connect
 
 	connection_info conn_info;
 	conn_info.connection = connection;
+	conn_info.connector_id = info->connector_id;
 
 	// sentinel to be used to monitor if connection has been removed
 	// instead of expensive lookup into the connections container.
@@ -191,35 +301,63 @@ void messenger<T, OArchive, IArchive>::on_new_connection(connection_ptr& connect
 		shared_this->on_disconnect(id, ec, info);
 	});
 
+	// The details are shared by the callbacks deferred from the io thread
+	// until they change. Messages of a connection are received one at a time.
 	auto sentinel = std::weak_ptr<void>(conn_info.sentinel);
+	auto shared_details = std::make_shared<details_ptr>();
 	connection->on_msg.emplace_front(
-		[weak_this, info, sentinel](connection::id_t id, byte_buffer msg, data_channel channel, const connection::details& details) {
+		[weak_this, info, sentinel, shared_details](connection::id_t id, const shared_buffer& msg,
+													data_channel channel, const connection::details& details) {
 			auto shared_this = weak_this.lock();
 			if(!shared_this || sentinel.expired())
 			{
 				return;
 			}
 
-			shared_this->on_raw_msg(id, msg, channel, info, details);
+			shared_this->on_raw_msg(id, msg, channel, info, details, *shared_details);
 		});
-    connection->start();
 
-	on_connect(connection->id, std::move(conn_info), info);
+	if(info->on_high_water)
+	{
+		connection->on_high_water.emplace_back([weak_this, info, sentinel](connection::id_t id) {
+			auto shared_this = weak_this.lock();
+			if(!shared_this || sentinel.expired())
+			{
+				return;
+			}
+
+			shared_this->dispatch(info, id, [info, id]() { info->on_high_water(id); });
+		});
+	}
 
+	if(info->on_drained)
+	{
+		connection->on_drained.emplace_back([weak_this, info, sentinel](connection::id_t id) {
+			auto shared_this = weak_this.lock();
+			if(!shared_this || sentinel.expired())
+			{
+				return;
+			}
+
+			shared_this->dispatch(info, id, [info, id]() { info->on_drained(id); });
+		});
+	}
+
+	// The connection is known before it is started, so that
+	// on_connect is called before anything received from it.
+	on_connect(connection->id, std::move(conn_info), info);
+	connection->start();
 }
 
 template <typename T, typename OArchive, typename IArchive>
 void messenger<T, OArchive, IArchive>::on_connect(connection::id_t id, connection_info&& conn_info,
 												  const user_info_ptr& info)
 {
-	{
-		std::lock_guard<std::mutex> lock(guard_);
-		connections_.emplace(id, std::move(conn_info));
-	}
+	connections_.insert(id, conn_info.connector_id, conn_info);
 
 	if(info->on_connect)
 	{
-		info->on_connect(id);
+		dispatch(info, id, [info, id]() { info->on_connect(id); });
 	}
 }
 
@@ -227,34 +365,32 @@ template <typename T, typename OArchive, typename IArchive>
 void messenger<T, OArchive, IArchive>::on_disconnect(connection::id_t id, error_code ec,
 													 const user_info_ptr& info)
 {
+	connections_.erase(id);
+
+	// Also remove connector if the data is corrupt
+	if(is_data_corruption_error(ec))
 	{
 		std::lock_guard<std::mutex> lock(guard_);
-		connections_.erase(id);
-
-		// Also remove connector if the data is corrupt
-		if(is_data_corruption_error(ec))
-		{
-			connectors_.erase(info->connector_id);
-		}
+		connectors_.erase(info->connector_id);
 	}
 	if(info->on_disconnect)
 	{
-		info->on_disconnect(id, ec);
+		dispatch(info, id, [info, id, ec]() { info->on_disconnect(id, ec); });
 	}
 }
 
 template <typename T, typename OArchive, typename IArchive>
-void messenger<T, OArchive, IArchive>::on_raw_msg(connection::id_t id, byte_buffer& raw_msg,
+void messenger<T, OArchive, IArchive>::on_raw_msg(connection::id_t id, const shared_buffer& raw_msg,
 												  data_channel channel, const user_info_ptr& info,
-                                                  const connection::details& details)
+												  const connection::details& details, details_ptr& shared_details)
 {
 	try
 	{
-		auto msg = serializer_t::from_buffer(std::move(raw_msg));
+		auto msg = detail::from_buffer<serializer_t>(raw_msg);
 
 		if(detail::is_msg(channel))
 		{
-			on_msg(id, msg, info, details);
+			on_msg(id, msg, info, details, shared_details);
 		}
 		else
 		{
@@ -273,36 +409,110 @@ void messenger<T, OArchive, IArchive>::on_raw_msg(connection::id_t id, byte_buff
 }
 
 template <typename T, typename OArchive, typename IArchive>
-void messenger<T, OArchive, IArchive>::on_msg(connection::id_t id, msg_t& msg, const user_info_ptr& info, const connection::details& details)
+void messenger<T, OArchive, IArchive>::on_msg(connection::id_t id, msg_t& msg, const user_info_ptr& info,
+											  const connection::details& details, details_ptr& shared_details)
 {
+	if(!info->on_msg)
+	{
+		return;
+	}
 
-	if(info->on_msg)
+	if(info->dispatch == dispatch_policy::io_thread)
 	{
 		info->on_msg(id, std::move(msg), details);
+		return;
 	}
+
+	// The callbacks of a connection are kept in order by its id.
+	auto key = info->msg_key ? info->msg_key(id, msg) : id;
+	if(!shared_details || shared_details->local_endpoint != details.local_endpoint ||
+	   shared_details->remote_endpoint != details.remote_endpoint || shared_details->endpoint != details.endpoint)
+	{
+		shared_details = std::make_shared<const connection::details>(details);
+	}
+
+	dispatch(info, key, [info, id, msg = std::move(msg), details = shared_details]() mutable {
+		info->on_msg(id, std::move(msg), *details);
+	});
 }
 
 template <typename T, typename OArchive, typename IArchive>
-void messenger<T, OArchive, IArchive>::send(connection::id_t id, msg_t& msg, data_channel channel)
+void messenger<T, OArchive, IArchive>::dispatch(const user_info_ptr& info, uint64_t key,
+												dispatcher::task_t task)
 {
-	std::unique_lock<std::mutex> lock(guard_);
+	dispatcher_.dispatch(info->dispatch, key, std::move(task));
+}
 
-	auto conn_it = connections_.find(id);
-	if(conn_it == std::end(connections_))
+template <typename T, typename OArchive, typename IArchive>
+send_status messenger<T, OArchive, IArchive>::send(connection::id_t id, msg_t& msg, data_channel channel)
+{
+	// get a copy as after it is removed
+	// we may be the last user of this connection.
+	connection_info conn_info;
+	if(!connections_.find(id, conn_info))
 	{
-		return;
+		return send_status::disconnected;
+	}
+
+	return detail::send<serializer_t>(*conn_info.connection, msg, channel);
+}
+
+template <typename T, typename OArchive, typename IArchive>
+size_t messenger<T, OArchive, IArchive>::send_shared(std::vector<connection_info>& targets, const msg_t& msg,
+													 data_channel channel)
+{
+	if(targets.empty())
+	{
+		return 0;
 	}
-	auto& conn_info = conn_it->second;
 
-	// get a copy so that we can unlock
-	// and work on unlocked mutex
-	// after the unlock we may be the last
-	// user of this connection.
-	auto connection = conn_info.connection;
+	// Connections of the same connector have their builders made by the same
+	// creator, so the message is framed once per connector by any of them.
+	std::stable_sort(std::begin(targets), std::end(targets),
+					 [](const connection_info& lhs, const connection_info& rhs) {
+						 return lhs.connector_id < rhs.connector_id;
+					 });
 
-	lock.unlock();
+	auto payload = serializer_t::to_buffer(msg);
+
+	size_t sent = 0;
+	auto begin = std::begin(targets);
+	while(begin != std::end(targets))
+	{
+		auto connector_id = begin->connector_id;
+		auto end = std::find_if(begin, std::end(targets), [connector_id](const connection_info& info) {
+			return info.connector_id != connector_id;
+		});
+
+		// The last connector takes the payload, the others frame a copy of it.
+		auto connector_payload = end == std::end(targets) ? std::move(payload) : payload;
+
+		// we assume this is thread safe as it is const.
+		auto built = begin->connection->builder->build(std::move(connector_payload), channel);
+		auto frames = std::move(built.split);
+		if(frames.empty())
+		{
+			frames.emplace_back();
+			frames.back().reserve(built.frame.size());
+			for(auto& buffer : built.frame)
+			{
+				frames.back().emplace_back(std::move(buffer));
+			}
+		}
+
+		for(auto it = begin; it != end; ++it)
+		{
+			auto status = it->connection->send_shared(frames, channel);
+			if(status == send_status::queued || status == send_status::above_high_water)
+			{
+				++sent;
+			}
+		}
+
+		begin = end;
+	}
 
-	connection->send_msg(serializer_t::to_buffer(msg), channel);
+	return sent;
 }
 
 template <typename T, typename OArchive, typename IArchive>
@@ -0,0 +1,95 @@
+#include "buffer_pool.h"
+
+namespace net
+{
+
+buffer_pool::buffer_pool(size_t max_buffers, size_t max_capacity)
+    : max_buffers_(max_buffers)
+    , max_capacity_(max_capacity)
+{
+    // reserve upfront so that returning buffers never allocates
+    buffers_.reserve(max_buffers_);
+    blocks_.reserve(max_buffers_);
+}
+
+buffer_pool::~buffer_pool()
+{
+    for(auto b : blocks_)
+    {
+        delete b;
+    }
+}
+
+byte_buffer buffer_pool::acquire(size_t size)
+{
+    byte_buffer buffer;
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        if(!buffers_.empty())
+        {
+            buffer = std::move(buffers_.back());
+            buffers_.pop_back();
+        }
+    }
+
+    buffer.resize(size);
+    return buffer;
+}
+
+void buffer_pool::release(byte_buffer&& buffer)
+{
+    if(buffer.capacity() == 0 || buffer.capacity() > max_capacity_)
+    {
+        return;
+    }
+
+    buffer.clear();
+
+    std::lock_guard<std::mutex> lock(guard_);
+    if(buffers_.size() < max_buffers_)
+    {
+        buffers_.emplace_back(std::move(buffer));
+    }
+}
+
+shared_buffer buffer_pool::share(byte_buffer&& buffer)
+{
+    block* b = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        if(!blocks_.empty())
+        {
+            b = blocks_.back();
+            blocks_.pop_back();
+        }
+    }
+
+    if(!b)
+    {
+        b = new block();
+    }
+
+    b->refs.store(1, std::memory_order_relaxed);
+    b->data = std::move(buffer);
+    b->pool = shared_from_this();
+    return shared_buffer(b);
+}
+
+void buffer_pool::recycle(block* b) noexcept
+{
+    auto data = std::move(b->data);
+    release(std::move(data));
+
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        if(blocks_.size() < max_buffers_)
+        {
+            blocks_.emplace_back(b);
+            return;
+        }
+    }
+
+    delete b;
+}
+
+} // namespace net
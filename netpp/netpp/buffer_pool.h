@@ -0,0 +1,63 @@
+#pragma once
+#include "shared_buffer.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace net
+{
+
+//-----------------------------------------------------------------------------
+/// Thread safe recycler of byte buffers and shared buffer storage.
+/// Buffers keep their capacity while in the pool, so at steady state
+/// acquiring a buffer does not allocate.
+//-----------------------------------------------------------------------------
+class buffer_pool : public std::enable_shared_from_this<buffer_pool>
+{
+public:
+    //-----------------------------------------------------------------------------
+    /// 'max_buffers' - how many free buffers to keep around. 0 disables recycling.
+    /// 'max_capacity' - buffers with a bigger capacity are freed instead of kept.
+    //-----------------------------------------------------------------------------
+    buffer_pool(size_t max_buffers, size_t max_capacity);
+    ~buffer_pool();
+
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool& operator=(const buffer_pool&) = delete;
+
+    //-----------------------------------------------------------------------------
+    /// Gets a buffer resized to the specified size.
+    //-----------------------------------------------------------------------------
+    byte_buffer acquire(size_t size);
+
+    //-----------------------------------------------------------------------------
+    /// Returns a buffer to the pool.
+    //-----------------------------------------------------------------------------
+    void release(byte_buffer&& buffer);
+
+    //-----------------------------------------------------------------------------
+    /// Wraps the buffer in a shared_buffer without copying it. The buffer
+    /// comes back to this pool when the last shared_buffer view is released.
+    //-----------------------------------------------------------------------------
+    shared_buffer share(byte_buffer&& buffer);
+
+private:
+    friend class shared_buffer;
+
+    using block = shared_buffer::block;
+
+    //-----------------------------------------------------------------------------
+    /// Called by shared_buffer when the last reference to a block is released.
+    //-----------------------------------------------------------------------------
+    void recycle(block* b) noexcept;
+
+    const size_t max_buffers_;
+    const size_t max_capacity_;
+
+    std::mutex guard_;
+    std::vector<byte_buffer> buffers_;
+    std::vector<block*> blocks_;
+};
+
+} // namespace net
@@ -0,0 +1,8 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+namespace net
+{
+using byte_buffer = std::vector<uint8_t>;
+} // namespace net
@@ -0,0 +1,113 @@
+#pragma once
+#include "connection.h"
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace net
+{
+
+/// What sending does while the output queue is above its high watermark.
+enum class high_water_policy
+{
+    /// queue the message anyway
+    queue,
+    /// drop the message
+    drop,
+    /// wait until the output queue drains to its low watermark
+    block,
+    /// disconnect with errc::output_queue_full
+    disconnect
+};
+
+struct connection_config
+{
+    /// When enabled the connection reads whatever is available on the socket
+    /// into a reusable receive buffer and lets the builder carve out as many
+    /// complete frames as are present per completion, carrying partial frames
+    /// over to the next read. Otherwise a separate exact-sized read is issued
+    /// for every operation requested by the builder.
+    bool bulk_read = false;
+
+    /// Size of the receive buffer used in bulk read mode.
+    std::size_t bulk_read_buffer_size = 64 * 1024;
+
+    /// How many free buffers each connection keeps for reuse by its builder,
+    /// output queue and delivered messages. 0 disables recycling.
+    std::size_t buffer_pool_size = 8;
+
+    /// Buffers with a bigger capacity are freed instead of recycled.
+    std::size_t buffer_pool_max_capacity = 16 * 1024;
+
+    /// Maximum size of a buffered message. A peer announcing a bigger one
+    /// is disconnected with errc::msg_size_exceeded before anything is
+    /// allocated for it. 0 means no limit.
+    std::size_t max_msg_size = 0;
+
+    /// Messages with a payload bigger than this are not buffered whole
+    /// but streamed to on_msg_chunk in chunks of at most this size,
+    /// so memory stays bounded while they are transferred.
+    /// Streamed messages are not limited by max_msg_size.
+    /// Only stream oriented (tcp) connections support it.
+    /// 0 disables streaming.
+    std::size_t stream_chunk_size = 0;
+
+    /// Subscriber for streamed messages added to every connection.
+    connection::on_msg_chunk_t on_msg_chunk;
+
+    /// How long small messages may be held back so that they are
+    /// written together with the ones sent right after them. Stream oriented
+    /// (tcp) connections also disable Nagle's algorithm and cork the socket
+    /// while there is more to write. 0 writes every message right away.
+    std::chrono::microseconds coalesce_delay{0};
+
+    /// Held back messages are written as soon as this many bytes are queued.
+    std::size_t coalesce_max_bytes = 64 * 1024;
+
+    /// Most bytes passed to a single write. A single message
+    /// bigger than this is still written with a single write.
+    std::size_t write_batch_max_bytes = 256 * 1024;
+
+    /// When enabled a message sent while nothing is being written is written
+    /// right away on the sending thread, as far as the socket accepts it
+    /// without blocking. Only the rest goes through the io thread.
+    /// Only plain (non ssl) tcp connections support it.
+    /// Ignored while coalescing.
+    bool direct_write = false;
+
+    /// Bytes and messages of the output queue at which it is above its high
+    /// watermark. It stays there until it drains to both low watermarks.
+    /// on_high_water and on_drained subscribers are notified of the changes.
+    /// 0 means no limit.
+    std::size_t high_water_bytes = 0;
+    std::size_t high_water_msgs = 0;
+    std::size_t low_water_bytes = 0;
+    std::size_t low_water_msgs = 0;
+
+    /// What sending does while the output queue is above its high watermark.
+    /// Sends from the io threads of the connection never block, they queue.
+    high_water_policy overflow = high_water_policy::queue;
+
+    /// Priority lanes of the output queue, highest first. A lane's weight is
+    /// how many frames it may commit in a row while the lanes after it wait.
+    /// A message which is not split is a single frame, so it counts once
+    /// however big it is. A weight of 0 gives the lane strict priority over
+    /// the lanes after it.
+    /// Frames are committed to the socket a write at a time, and a frame is
+    /// written whole by a single async_write. A frame on a higher lane thus
+    /// waits for the write in progress, which for a big message which is not
+    /// split means the whole message. Builders with a fragment size split big
+    /// messages into several frames (see msg_builder::build), which
+    /// take turns with the other messages of their lane, so those may arrive
+    /// before them.
+    /// Heartbeats always go on the first lane. Empty means a single lane.
+    std::vector<std::size_t> lane_weights;
+
+    /// Maps the channel of a sent message to its lane.
+    /// If not set, messages go on the last lane.
+    std::function<std::size_t(data_channel)> channel_lane;
+};
+
+} // namespace net
@@ -2,7 +2,9 @@
 
 #include "msg_builder.h"
 #include "error_code.h"
+#include "shared_buffer.h"
 
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <string>
@@ -12,6 +14,19 @@ namespace net
 {
 //----------------------------------------------------------------------
 
+/// Outcome of sending a message.
+enum class send_status
+{
+    /// the message was queued
+    queued,
+    /// the message was queued but the output queue is above its high watermark
+    above_high_water,
+    /// the message was dropped because the output queue is above its high watermark
+    dropped,
+    /// the message was dropped because the connection is stopped
+    disconnected
+};
+
 struct connection
 {
     struct details
@@ -32,7 +47,21 @@ struct connection
     //-----------------------------------------------------------------------------
     using id_t = uint64_t;
     using on_disconnect_t = std::function<void(connection::id_t, const error_code&)>;
-    using on_msg_t = std::function<void(connection::id_t, byte_buffer, data_channel, const details&)>;
+    using on_msg_t =
+        std::function<void(connection::id_t, const shared_buffer&, data_channel, const details&)>;
+
+    /// Stages of a message streamed to on_msg_chunk subscribers.
+    /// 'begin' and 'end' carry an empty buffer.
+    enum class stream_stage
+    {
+        begin,
+        chunk,
+        end
+    };
+    using on_msg_chunk_t = std::function<void(connection::id_t, stream_stage, const shared_buffer&,
+                                              data_channel, std::size_t total_size)>;
+    using on_high_water_t = std::function<void(connection::id_t)>;
+    using on_drained_t = std::function<void(connection::id_t)>;
 
     connection();
     virtual ~connection() = default;
@@ -40,24 +69,62 @@ struct connection
     //-----------------------------------------------------------------------------
     /// Sends the message through the specified channel
     //-----------------------------------------------------------------------------
-    virtual void send_msg(byte_buffer&& msg, data_channel channel) = 0;
+    virtual send_status send_msg(byte_buffer&& msg, data_channel channel) = 0;
+
+    //-----------------------------------------------------------------------------
+    /// Sends a message serialized into a buffer got from
+    /// builder->acquire_msg_buffer(channel), which is framed in place.
+    //-----------------------------------------------------------------------------
+    virtual send_status send_msg_in_place(byte_buffer&& msg, data_channel channel) = 0;
 
     //-----------------------------------------------------------------------------
-    /// Starts the connection.
+    /// Sends a message already framed by a builder made by the same creator
+    /// as the one of this connection. The buffers are shared, so the same
+    /// frames can be sent through many connections without copying them.
+    //-----------------------------------------------------------------------------
+    virtual send_status send_shared(const std::vector<std::vector<shared_buffer>>& frames,
+                                    data_channel channel) = 0;
+
+    //-----------------------------------------------------------------------------
+    /// Starts the connection. Messages sent before are written then.
+    /// Does nothing if the connection was stopped before.
     //-----------------------------------------------------------------------------
     virtual void start() = 0;
 
     //-----------------------------------------------------------------------------
     /// Stops the connection with the specified error code.
+    /// Does not wait for it. The subscribers of on_disconnect
+    /// are notified once the socket is closed.
     //-----------------------------------------------------------------------------
     virtual void stop(const error_code& ec) = 0;
 
-    /// container of subscribers for on_msg
+    //-----------------------------------------------------------------------------
+    /// Stops the connection with the specified error code once everything
+    /// sent so far is written and the peer closed its side, but waits for
+    /// 'linger' at most. Messages sent meanwhile are refused.
+    /// Does not wait for it, like stop.
+    //-----------------------------------------------------------------------------
+    virtual void stop_gracefully(const error_code& ec, std::chrono::milliseconds linger) = 0;
+
+    /// container of subscribers for on_msg.
+    /// All subscribers share the same immutable message buffer.
     std::deque<on_msg_t> on_msg;
 
+    /// container of subscribers for streamed messages.
+    /// Chunks of a message are delivered in order, between 'begin' and 'end'.
+    std::deque<on_msg_chunk_t> on_msg_chunk;
+
     /// container of subscribers for on_disconnect
     std::deque<on_disconnect_t> on_disconnect;
 
+    /// container of subscribers notified when the output queue
+    /// reaches its high watermark. Called on the sending thread.
+    std::deque<on_high_water_t> on_high_water;
+
+    /// container of subscribers notified when the output queue drains
+    /// back to its low watermark after reaching the high one.
+    std::deque<on_drained_t> on_drained;
+
     /// unique msg_builder for this connection
     msg_builder_ptr builder;
 
@@ -1,4 +1,5 @@
 #pragma once
+#include "config.h"
 #include "connection.h"
 #include <functional>
 
@@ -24,6 +25,10 @@ struct connector
     on_connection_ready_t on_connection_ready;
 
     msg_builder_creator create_builder;
+
+    /// config for the connections created by this connector
+    connection_config config;
+
     /// connector id
     const id_t id;
 };
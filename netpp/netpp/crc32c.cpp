@@ -0,0 +1,146 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define NETPP_CRC32C_SSE42 1
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(NETPP_CRC32C_SSE42) && (defined(__GNUC__) || defined(__clang__))
+#define NETPP_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define NETPP_TARGET_SSE42
+#endif
+
+namespace net
+{
+namespace utils
+{
+namespace
+{
+// reflected Castagnoli polynomial
+constexpr uint32_t polynomial = 0x82f63b78;
+
+struct crc_tables
+{
+    uint32_t table[8][256];
+};
+
+crc_tables make_tables()
+{
+    crc_tables result{};
+    for(uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc >> 1) ^ (polynomial & (0u - (crc & 1u)));
+        }
+        result.table[0][i] = crc;
+    }
+
+    for(uint32_t i = 0; i < 256; ++i)
+    {
+        for(size_t t = 1; t < 8; ++t)
+        {
+            auto prev = result.table[t - 1][i];
+            result.table[t][i] = (prev >> 8) ^ result.table[0][prev & 0xff];
+        }
+    }
+    return result;
+}
+
+const crc_tables tables = make_tables();
+
+// Slicing by 8, processes 8 bytes per step using 8 lookup tables.
+uint32_t crc32c_software(const uint8_t* data, size_t size, uint32_t crc)
+{
+    const auto& t = tables.table;
+    while(size >= 8)
+    {
+        // the tables expect the bytes in little endian order
+        uint32_t lo = uint32_t(data[0]) | uint32_t(data[1]) << 8 | uint32_t(data[2]) << 16 |
+                      uint32_t(data[3]) << 24;
+        uint32_t hi = uint32_t(data[4]) | uint32_t(data[5]) << 8 | uint32_t(data[6]) << 16 |
+                      uint32_t(data[7]) << 24;
+        lo ^= crc;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        data += 8;
+        size -= 8;
+    }
+
+    while(size-- > 0)
+    {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(NETPP_CRC32C_SSE42)
+NETPP_TARGET_SSE42 uint32_t crc32c_sse42(const uint8_t* data, size_t size, uint32_t crc)
+{
+    uint64_t crc64 = crc;
+    while(size >= 8)
+    {
+        uint64_t word = 0;
+        std::memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+
+    auto crc32 = uint32_t(crc64);
+    while(size-- > 0)
+    {
+        crc32 = _mm_crc32_u8(crc32, *data++);
+    }
+    return crc32;
+}
+
+bool has_sse42()
+{
+#if defined(_MSC_VER)
+    int info[4] = {};
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+#endif
+
+using crc32c_impl = uint32_t (*)(const uint8_t*, size_t, uint32_t);
+
+crc32c_impl select_impl()
+{
+#if defined(NETPP_CRC32C_SSE42)
+    if(has_sse42())
+    {
+        return &crc32c_sse42;
+    }
+#endif
+    return &crc32c_software;
+}
+
+const crc32c_impl impl = select_impl();
+
+} // namespace
+
+uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc)
+{
+    return ~impl(data, size, ~crc);
+}
+
+bool crc32c_hardware_supported()
+{
+    return impl != &crc32c_software;
+}
+
+} // namespace utils
+} // namespace net
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace net
+{
+namespace utils
+{
+
+//-----------------------------------------------------------------------------
+/// Computes the CRC32C (Castagnoli) checksum of the data.
+/// Pass a previously returned value as 'crc' to continue the checksum
+/// over data split across several buffers.
+/// Uses the SSE4.2 crc32 instruction when the cpu supports it
+/// and a table driven implementation otherwise.
+//-----------------------------------------------------------------------------
+uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc = 0);
+
+//-----------------------------------------------------------------------------
+/// Checks whether crc32c runs on the hardware accelerated implementation.
+//-----------------------------------------------------------------------------
+bool crc32c_hardware_supported();
+
+} // namespace utils
+} // namespace net
@@ -24,6 +24,12 @@ std::string net::net_err_category::message(int ev) const
         case errc::host_unreachable:
             return "Host is unreachable.";
 
+        case errc::msg_size_exceeded:
+            return "Message exceeds the maximum allowed size.";
+
+        case errc::output_queue_full:
+            return "Output queue is full.";
+
         default:
             return "(Unrecognized error)";
     }
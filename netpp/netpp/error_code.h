@@ -11,6 +11,8 @@ enum class errc : int
     data_corruption = 1, // Data corruption or unknown data format
     user_triggered_disconnect = 2,
     host_unreachable = 3,
+    msg_size_exceeded = 4, // Message exceeds the maximum allowed size
+    output_queue_full = 5, // The peer does not keep up with the sent messages
 };
 std::error_code make_error_code(errc);
 
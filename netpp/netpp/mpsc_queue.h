@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <utility>
+
+namespace net
+{
+
+//-----------------------------------------------------------------------------
+/// Unbounded lock-free queue for many producers and a single consumer.
+/// Pushing never blocks and never waits for other producers or the consumer.
+/// A push which is in progress may not be visible to pop yet,
+/// but it is visible to empty.
+//-----------------------------------------------------------------------------
+template <typename T>
+class mpsc_queue
+{
+public:
+    mpsc_queue()
+        : head_(new node)
+        , tail_(head_.load(std::memory_order_relaxed))
+    {
+    }
+
+    ~mpsc_queue()
+    {
+        T value;
+        while(pop(value))
+        {
+        }
+        delete tail_;
+    }
+
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+    //-----------------------------------------------------------------------------
+    /// Adds a value to the queue. Can be called from any thread.
+    //-----------------------------------------------------------------------------
+    void push(T&& value)
+    {
+        auto n = new node;
+        n->value = std::move(value);
+
+        // Sequentially consistent so that a consumer which checks empty
+        // right after going to sleep cannot miss the push.
+        auto prev = head_.exchange(n);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Takes the oldest value out of the queue if there is one.
+    /// Should only be called by the consumer.
+    //-----------------------------------------------------------------------------
+    bool pop(T& value)
+    {
+        auto next = tail_->next.load(std::memory_order_acquire);
+        if(next == nullptr)
+        {
+            return false;
+        }
+
+        // The popped node becomes the new sentinel.
+        value = std::move(next->value);
+        delete tail_;
+        tail_ = next;
+        return true;
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Checks whether anything has been pushed and not popped yet.
+    /// Should only be called by the consumer.
+    //-----------------------------------------------------------------------------
+    bool empty() const
+    {
+        return head_.load() == tail_;
+    }
+
+private:
+    struct node
+    {
+        std::atomic<node*> next{nullptr};
+        T value{};
+    };
+
+    /// the last pushed node, shared by the producers
+    std::atomic<node*> head_;
+
+    /// the sentinel before the oldest value, owned by the consumer
+    node* tail_;
+};
+
+} // namespace net
@@ -0,0 +1,66 @@
+#include "msg_builder.h"
+#include "buffer_pool.h"
+
+namespace net
+{
+
+constexpr size_t msg_builder::max_open_streams;
+
+msg_frames msg_builder::build_parts(std::vector<byte_buffer>&& parts, data_channel channel) const
+{
+    if(parts.size() == 1)
+    {
+        return build(std::move(parts.front()), channel);
+    }
+
+    size_t size = 0;
+    for(const auto& part : parts)
+    {
+        size += part.size();
+    }
+
+    auto msg = acquire_buffer(0);
+    msg.reserve(size);
+    for(auto& part : parts)
+    {
+        msg.insert(msg.end(), part.begin(), part.end());
+        release_buffer(std::move(part));
+    }
+
+    return build(std::move(msg), channel);
+}
+
+byte_buffer msg_builder::acquire_msg_buffer(data_channel) const
+{
+    return acquire_buffer(0);
+}
+
+byte_buffer msg_builder::acquire_buffer(size_t size) const
+{
+    if(pool_)
+    {
+        return pool_->acquire(size);
+    }
+
+    return byte_buffer(size);
+}
+
+void msg_builder::release_buffer(byte_buffer&& buffer) const
+{
+    if(pool_)
+    {
+        pool_->release(std::move(buffer));
+    }
+}
+
+shared_buffer msg_builder::share_buffer(byte_buffer&& buffer) const
+{
+    if(pool_)
+    {
+        return pool_->share(std::move(buffer));
+    }
+
+    return shared_buffer(std::move(buffer));
+}
+
+} // namespace net
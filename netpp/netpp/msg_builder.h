@@ -1,5 +1,7 @@
 #pragma once
+#include "byte_buffer.h"
 #include "logging.h"
+#include "shared_buffer.h"
 
 #include <algorithm>
 #include <cassert>
@@ -10,9 +12,11 @@
 
 namespace net
 {
-using byte_buffer = std::vector<uint8_t>;
 using data_channel = uint64_t;
 
+class buffer_pool;
+using buffer_pool_ptr = std::shared_ptr<buffer_pool>;
+
 namespace utils
 {
 
@@ -104,12 +108,32 @@ inline size_t from_bytes(std::vector<T>& data, const uint8_t* src)
 }
 }
 
+//-----------------------------------------------------------------------------
+/// A message built by a msg_builder. Frames of different messages may be
+/// interleaved on the wire, each is a list of buffers sent back to back.
+//-----------------------------------------------------------------------------
+struct msg_frames
+{
+    /// buffers of a message built as a single frame. e.g. a header in its own
+    /// small buffer followed by the moved in payload, which is not copied.
+    std::vector<byte_buffer> frame;
+
+    /// frames of a message split into several, set instead of 'frame', so
+    /// that a big message does not delay the ones sent after it. Their
+    /// payloads are slices of the message, which is not copied either.
+    std::vector<std::vector<shared_buffer>> split;
+};
+
 struct msg_builder
 {
     using creator = std::function<std::unique_ptr<msg_builder>()>;
 
     virtual ~msg_builder() = default;
 
+    /// Most messages split into several frames a peer accepts to receive at
+    /// once. Senders hold back the ones beyond it until one is complete.
+    static constexpr size_t max_open_streams = 64;
+
     enum class op_type
     {
         read_bytes,
@@ -120,14 +144,43 @@ struct msg_builder
     {
         size_t bytes = 0;
         op_type type = op_type::read_bytes;
+
+        /// The bytes are the payload of a message on 'channel'.
+        /// The connection may stream such bytes to its subscribers in chunks
+        /// instead of buffering them, in which case process_operation is
+        /// called without them being appended to the work buffer.
+        bool payload = false;
+        data_channel channel = 0;
     };
 
     //-----------------------------------------------------------------------------
     /// Builds a message provided payload and channel.
     /// This function is responsible to properly format
     /// the message e.g (a header/payload approach or a completely custom format).
+    /// A message is built either as a single frame, whose buffers are moved in,
+    /// or split into several frames sharing the payload, see msg_frames.
+    /// 'in_place' - the message was got from acquire_msg_buffer with the
+    /// payload appended to it. Builders which frame payloads in place write
+    /// the header into the room reserved for it, so that a frame is a single
+    /// buffer and the payload is not copied.
+    //-----------------------------------------------------------------------------
+    virtual msg_frames build(byte_buffer&& msg, data_channel channel = 0, bool in_place = false) const = 0;
+
+    //-----------------------------------------------------------------------------
+    /// Builds a message provided a payload made of several parts.
+    /// The parts are framed as a single payload in the given order.
+    /// Builders which can not frame the parts as they are should override
+    /// this, the default implementation joins them into a single buffer.
     //-----------------------------------------------------------------------------
-    virtual std::vector<byte_buffer> build(byte_buffer&& msg, data_channel channel = 0) const = 0;
+    virtual msg_frames build_parts(std::vector<byte_buffer>&& parts, data_channel channel = 0) const;
+
+    //-----------------------------------------------------------------------------
+    /// Gets a buffer for a payload to be serialized into by appending to it,
+    /// to be built with 'in_place'. Builders which frame payloads in place
+    /// reserve room for the header at its front. The default implementation
+    /// reserves nothing.
+    //-----------------------------------------------------------------------------
+    virtual byte_buffer acquire_msg_buffer(data_channel channel = 0) const;
 
     //-----------------------------------------------------------------------------
     /// Set processed bytes count.
@@ -160,16 +213,60 @@ struct msg_builder
         return true;
     }
 
+    //-----------------------------------------------------------------------------
+    /// Sets a pool to draw work and header buffers from.
+    /// The connection owning the builder returns them once they are consumed.
+    /// Builders wrapping other builders should pass it on.
+    //-----------------------------------------------------------------------------
+    virtual void set_buffer_pool(buffer_pool_ptr pool)
+    {
+        pool_ = std::move(pool);
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Sets the maximum size of a received message, for builders which
+    /// put it together from several frames. 0 means no limit.
+    /// Builders wrapping other builders should pass it on.
+    //-----------------------------------------------------------------------------
+    virtual void set_max_msg_size(size_t size)
+    {
+        max_msg_size_ = size;
+    }
+
     //-----------------------------------------------------------------------------
     /// Create a creator of any derived type.
+    /// The arguments are copied and passed to the constructor of every builder.
     //-----------------------------------------------------------------------------
-    template <typename T>
-    static creator get_creator()
+    template <typename T, typename... Args>
+    static creator get_creator(Args... args)
     {
         static_assert(std::is_base_of<msg_builder, T>::value, "Only derived classes"
                                                               "can be created this way.");
-        return []() { return std::make_unique<T>(); };
+        return [=]() { return std::make_unique<T>(args...); };
     }
+
+protected:
+    //-----------------------------------------------------------------------------
+    /// Gets a buffer of the specified size, recycled from the pool if there is one.
+    //-----------------------------------------------------------------------------
+    byte_buffer acquire_buffer(size_t size) const;
+
+    //-----------------------------------------------------------------------------
+    /// Returns a buffer which is no longer needed to the pool if there is one.
+    //-----------------------------------------------------------------------------
+    void release_buffer(byte_buffer&& buffer) const;
+
+    //-----------------------------------------------------------------------------
+    /// Wraps a buffer in a shared_buffer without copying it,
+    /// returning it to the pool once released if there is one.
+    //-----------------------------------------------------------------------------
+    shared_buffer share_buffer(byte_buffer&& buffer) const;
+
+    /// pool to draw buffers from. May be empty.
+    buffer_pool_ptr pool_;
+
+    /// maximum size of a received message. 0 means no limit.
+    size_t max_msg_size_ = 0;
 };
 
 using msg_builder_ptr = std::unique_ptr<msg_builder>;
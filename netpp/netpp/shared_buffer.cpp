@@ -0,0 +1,99 @@
+#include "shared_buffer.h"
+#include "buffer_pool.h"
+
+namespace net
+{
+
+shared_buffer::shared_buffer(byte_buffer&& buffer)
+    : shared_buffer(new block())
+{
+    block_->data = std::move(buffer);
+    data_ = block_->data.data();
+    size_ = block_->data.size();
+}
+
+shared_buffer::shared_buffer(block* b) noexcept
+    : block_(b)
+    , data_(b->data.data())
+    , size_(b->data.size())
+{
+}
+
+shared_buffer::shared_buffer(const shared_buffer& rhs) noexcept
+    : block_(rhs.block_)
+    , data_(rhs.data_)
+    , size_(rhs.size_)
+{
+    if(block_)
+    {
+        block_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+shared_buffer::shared_buffer(shared_buffer&& rhs) noexcept
+    : block_(rhs.block_)
+    , data_(rhs.data_)
+    , size_(rhs.size_)
+{
+    rhs.block_ = nullptr;
+    rhs.data_ = nullptr;
+    rhs.size_ = 0;
+}
+
+shared_buffer& shared_buffer::operator=(const shared_buffer& rhs) noexcept
+{
+    if(this != &rhs)
+    {
+        shared_buffer tmp(rhs);
+        *this = std::move(tmp);
+    }
+    return *this;
+}
+
+shared_buffer& shared_buffer::operator=(shared_buffer&& rhs) noexcept
+{
+    if(this != &rhs)
+    {
+        release();
+        block_ = rhs.block_;
+        data_ = rhs.data_;
+        size_ = rhs.size_;
+        rhs.block_ = nullptr;
+        rhs.data_ = nullptr;
+        rhs.size_ = 0;
+    }
+    return *this;
+}
+
+shared_buffer::~shared_buffer()
+{
+    release();
+}
+
+void shared_buffer::release() noexcept
+{
+    if(!block_)
+    {
+        return;
+    }
+
+    if(block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        if(block_->pool)
+        {
+            // keep the pool alive while it takes the block back
+            auto pool = std::move(block_->pool);
+            pool->recycle(block_);
+        }
+        else
+        {
+            delete block_;
+        }
+    }
+
+    block_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+}
+
+} // namespace net
@@ -0,0 +1,115 @@
+#pragma once
+#include "byte_buffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+
+namespace net
+{
+class buffer_pool;
+
+//-----------------------------------------------------------------------------
+/// Ref-counted, immutable view over a byte buffer.
+/// Copies and slices share the same storage, so a received message
+/// can be handed to any number of subscribers without copying it.
+/// When the storage came from a buffer_pool it is returned there
+/// once the last view is released.
+//-----------------------------------------------------------------------------
+class shared_buffer
+{
+public:
+    using value_type = uint8_t;
+    using const_iterator = const uint8_t*;
+
+    shared_buffer() = default;
+
+    //-----------------------------------------------------------------------------
+    /// Takes ownership of the buffer without copying it.
+    //-----------------------------------------------------------------------------
+    explicit shared_buffer(byte_buffer&& buffer);
+
+    shared_buffer(const shared_buffer& rhs) noexcept;
+    shared_buffer(shared_buffer&& rhs) noexcept;
+    shared_buffer& operator=(const shared_buffer& rhs) noexcept;
+    shared_buffer& operator=(shared_buffer&& rhs) noexcept;
+    ~shared_buffer();
+
+    const uint8_t* data() const noexcept
+    {
+        return data_;
+    }
+
+    size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    bool empty() const noexcept
+    {
+        return size_ == 0;
+    }
+
+    const_iterator begin() const noexcept
+    {
+        return data_;
+    }
+
+    const_iterator end() const noexcept
+    {
+        return data_ + size_;
+    }
+
+    const uint8_t& operator[](size_t index) const noexcept
+    {
+        return data_[index];
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Returns a view over a part of this buffer sharing the same storage.
+    //-----------------------------------------------------------------------------
+    shared_buffer slice(size_t offset, size_t count = size_t(-1)) const
+    {
+        if(offset > size_)
+        {
+            throw std::out_of_range("shared_buffer::slice offset out of range");
+        }
+
+        shared_buffer result(*this);
+        result.data_ += offset;
+        result.size_ = std::min(count, size_ - offset);
+        return result;
+    }
+
+    //-----------------------------------------------------------------------------
+    /// Makes a mutable copy of the viewed bytes.
+    //-----------------------------------------------------------------------------
+    byte_buffer to_byte_buffer() const
+    {
+        return {begin(), end()};
+    }
+
+private:
+    friend class buffer_pool;
+
+    struct block
+    {
+        std::atomic<size_t> refs{1};
+        byte_buffer data;
+        std::shared_ptr<buffer_pool> pool;
+    };
+
+    //-----------------------------------------------------------------------------
+    /// Adopts a block with a single reference.
+    //-----------------------------------------------------------------------------
+    explicit shared_buffer(block* b) noexcept;
+
+    void release() noexcept;
+
+    block* block_ = nullptr;
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+} // namespace net
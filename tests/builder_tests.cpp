@@ -0,0 +1,328 @@
+#include "builder_tests.h"
+#include "test_utils.h"
+
+#include <builderpp/checksum_stage.h>
+#include <builderpp/compression_stage.h>
+#include <builderpp/msg_builder.h>
+#include <builderpp/pipeline_builder.h>
+
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <utility>
+#include <vector>
+
+using test::check;
+using test::check_throws;
+using test::make_payload;
+
+namespace
+{
+using received_msgs = std::vector<std::pair<net::byte_buffer, net::data_channel>>;
+
+template <typename Buffers>
+void append_frame(net::byte_buffer& wire, const Buffers& frame)
+{
+	for(const auto& buffer : frame)
+	{
+		wire.insert(std::end(wire), std::begin(buffer), std::end(buffer));
+	}
+}
+
+//-----------------------------------------------------------------------------
+/// Feeds the bytes to the builder the way a connection reads them.
+/// A message cut short is not returned.
+//-----------------------------------------------------------------------------
+received_msgs receive(net::msg_builder& builder, const net::byte_buffer& wire)
+{
+	received_msgs msgs;
+	size_t offset = 0;
+	while(offset < wire.size())
+	{
+		auto op = builder.get_next_operation();
+		if(offset + op.bytes > wire.size())
+		{
+			break;
+		}
+
+		auto& work = builder.get_work_buffer();
+		auto size = work.size();
+		work.resize(size + op.bytes);
+		std::memcpy(work.data() + size, wire.data() + offset, op.bytes);
+		offset += op.bytes;
+
+		if(builder.process_operation(op.bytes))
+		{
+			msgs.emplace_back(builder.extract_msg());
+		}
+	}
+	return msgs;
+}
+
+void append_msg(net::byte_buffer& wire, const net::msg_frames& frames)
+{
+	append_frame(wire, frames.frame);
+	for(const auto& frame : frames.split)
+	{
+		append_frame(wire, frame);
+	}
+}
+
+void send(const net::msg_builder& builder, net::byte_buffer msg, net::data_channel channel,
+		  net::byte_buffer& wire)
+{
+	append_msg(wire, builder.build(std::move(msg), channel));
+}
+
+void test_round_trip(const net::msg_builder::creator& creator, const char* test)
+{
+	auto sender = creator();
+	auto receiver = creator();
+
+	const std::vector<size_t> sizes{0, 1, 127, 128, 300, 70000};
+	const std::vector<net::data_channel> channels{0, 1, 300, std::numeric_limits<net::data_channel>::max()};
+
+	received_msgs sent;
+	net::byte_buffer wire;
+	for(auto size : sizes)
+	{
+		for(auto channel : channels)
+		{
+			auto payload = make_payload(size);
+			sent.emplace_back(payload, channel);
+			send(*sender, payload, channel, wire);
+
+			// as parts
+			std::vector<net::byte_buffer> parts(3);
+			parts[0].assign(std::begin(payload), std::begin(payload) + size / 3);
+			parts[1].assign(std::begin(payload) + size / 3, std::begin(payload) + size / 2);
+			parts[2].assign(std::begin(payload) + size / 2, std::end(payload));
+			sent.emplace_back(payload, channel);
+			append_msg(wire, sender->build_parts(std::move(parts), channel));
+
+			// in place
+			auto msg = sender->acquire_msg_buffer(channel);
+			msg.insert(std::end(msg), std::begin(payload), std::end(payload));
+			sent.emplace_back(payload, channel);
+			append_msg(wire, sender->build(std::move(msg), channel, true));
+		}
+	}
+
+	auto msgs = receive(*receiver, wire);
+	check(msgs == sent, test, "received messages differ from the sent ones");
+
+	// Nothing is returned for a message cut short.
+	net::byte_buffer truncated;
+	send(*sender, make_payload(300), 1, truncated);
+	truncated.pop_back();
+	check(receive(*creator(), truncated).empty(), test, "a truncated message was received");
+}
+
+void test_malformed()
+{
+	// 7 size bytes, when there are at most 4.
+	net::byte_buffer descriptor{0x87, 0, 0, 0, 0, 0, 0, 0};
+	check_throws([&]() { net::compact_buffer_builder receiver; receive(receiver, descriptor); },
+				 "compact_buffer_builder", "an invalid descriptor was accepted");
+
+	net::byte_buffer header;
+	send(net::single_buffer_builder(), make_payload(300), 1, header);
+	header[0] = uint8_t(header[0] + 1);
+	check_throws([&]() { net::single_buffer_builder receiver; receive(receiver, header); },
+				 "single_buffer_builder", "an invalid header size was accepted");
+}
+
+void test_checksum()
+{
+	const char* test = "single_buffer_builder crc32c";
+	test_round_trip(net::msg_builder::get_creator<net::single_buffer_builder>(true), test);
+
+	net::byte_buffer wire;
+	send(net::single_buffer_builder(true), make_payload(300), 1, wire);
+
+	// in the channel, the payload and the checksum
+	for(auto offset : {size_t(5), net::single_buffer_builder::get_header_size() + 10, wire.size() - 1})
+	{
+		auto corrupt = wire;
+		corrupt[offset] ^= 0x01;
+		check_throws([&]() { net::single_buffer_builder receiver(true); receive(receiver, corrupt); }, test,
+					 "a corrupt message passed the checksum");
+	}
+}
+
+void test_fragments()
+{
+	const char* test = "single_buffer_builder fragments";
+	test_round_trip(net::msg_builder::get_creator<net::single_buffer_builder>(true, size_t(1000)), test);
+
+	for(auto checksum : {false, true})
+	{
+		net::single_buffer_builder builder(checksum, 100);
+		const net::msg_builder& sender = builder;
+		net::single_buffer_builder receiver(checksum, 100);
+
+		// Frames of two split messages interleaved with a whole one.
+		auto first_payload = make_payload(1050);
+		auto second_payload = make_payload(420);
+		auto first = sender.build(net::byte_buffer(first_payload), 1).split;
+		auto second = sender.build(net::byte_buffer(second_payload), 2).split;
+		check(first.size() == 11 && second.size() == 5, test, "the messages were not split by the fragment size");
+
+		auto whole_payload = make_payload(50);
+		auto whole = sender.build(net::byte_buffer(whole_payload), 3);
+		check(whole.split.empty(), test, "a small message was split");
+
+		net::byte_buffer wire;
+		for(size_t i = 0; i < first.size(); ++i)
+		{
+			append_frame(wire, first[i]);
+			if(i < second.size())
+			{
+				append_frame(wire, second[i]);
+			}
+			if(i == 1)
+			{
+				append_msg(wire, whole);
+			}
+		}
+
+		auto msgs = receive(receiver, wire);
+		received_msgs expected{{whole_payload, 3}, {second_payload, 2}, {first_payload, 1}};
+		check(msgs == expected, test, "split messages were not put back together");
+
+		// Split in place.
+		auto msg = sender.acquire_msg_buffer(4);
+		msg.insert(std::end(msg), std::begin(first_payload), std::end(first_payload));
+		net::byte_buffer in_place;
+		append_msg(in_place, sender.build(std::move(msg), 4, true));
+		check(receive(receiver, in_place) == received_msgs{{first_payload, 4}}, test,
+			  "a message split in place was not put back together");
+	}
+
+	// A peer can not keep an unbounded number of split messages open.
+	net::single_buffer_builder sender(false, 10);
+	net::byte_buffer wire;
+	for(size_t i = 0; i <= net::msg_builder::max_open_streams; ++i)
+	{
+		append_frame(wire, sender.build(make_payload(20), 0, false).split.front());
+	}
+	check_throws([&]() { net::single_buffer_builder receiver(false, 10); receive(receiver, wire); }, test,
+				 "too many split messages were kept open");
+
+	// Split messages are bound by the maximum message size as they grow.
+	net::byte_buffer big;
+	send(sender, make_payload(100), 0, big);
+	check_throws(
+		[&]() {
+			net::single_buffer_builder receiver(false, 10);
+			receiver.set_max_msg_size(50);
+			receive(receiver, big);
+		},
+		test, "a split message over the maximum size was accepted");
+}
+
+#if defined(NETPP_WITH_ZLIB)
+void test_compression()
+{
+	const char* test = "compression_stage";
+
+	net::compression_stage sender;
+	std::vector<net::byte_buffer> parts{net::byte_buffer(10000, 'a')};
+	sender.encode(parts, 0);
+	net::byte_buffer compressed;
+	append_frame(compressed, parts);
+	check(compressed.size() < 1000, test, "a compressible payload was not compressed");
+
+	auto decoded = compressed;
+	net::compression_stage receiver;
+	receiver.decode(decoded, 0);
+	check(decoded == net::byte_buffer(10000, 'a'), test, "the payload was not decompressed");
+
+	// Payloads under the threshold are sent as they are.
+	std::vector<net::byte_buffer> small{make_payload(100)};
+	sender.encode(small, 0);
+	net::byte_buffer uncompressed;
+	append_frame(uncompressed, small);
+	receiver.decode(uncompressed, 0);
+	check(uncompressed == make_payload(100), test, "a small payload did not round trip");
+
+	// trailer : 4 bytes of size, 1 byte of method
+	auto claimed = compressed;
+	std::memset(claimed.data() + claimed.size() - 5, 0xff, 4);
+	check_throws([&]() { net::compression_stage().decode(claimed, 0); }, test,
+				 "an impossible decompressed size was accepted");
+
+	auto bounded = compressed;
+	check_throws(
+		[&]() {
+			net::compression_stage stage;
+			stage.set_max_msg_size(5000);
+			stage.decode(bounded, 0);
+		},
+		test, "a payload decompressing over the maximum size was accepted");
+
+	auto corrupt = compressed;
+	corrupt[corrupt.size() / 3] ^= 0xff;
+	check_throws([&]() { net::compression_stage().decode(corrupt, 0); }, test,
+				 "a corrupt compressed payload was accepted");
+
+	auto method = compressed;
+	method.back() = 7;
+	check_throws([&]() { net::compression_stage().decode(method, 0); }, test, "an unknown method was accepted");
+
+	net::byte_buffer truncated{1, 2};
+	check_throws([&]() { net::compression_stage().decode(truncated, 0); }, test,
+				 "a truncated payload was accepted");
+}
+#endif
+
+void test_pipeline()
+{
+	const char* test = "pipeline_builder";
+
+	std::vector<net::msg_stage::creator> stages;
+#if defined(NETPP_WITH_ZLIB)
+	stages.emplace_back(net::msg_stage::get_creator<net::compression_stage>());
+#endif
+	stages.emplace_back(net::msg_stage::get_creator<net::checksum_stage>());
+
+	for(const auto& framer : {net::msg_builder::get_creator<net::single_buffer_builder>(),
+							  net::msg_builder::get_creator<net::compact_buffer_builder>()})
+	{
+		test_round_trip(net::msg_builder::get_creator<net::pipeline_builder>(framer, stages), test);
+	}
+
+	// Only the payloads of the channels of a stage go through it.
+	auto creator = net::msg_builder::get_creator<net::pipeline_builder>(
+		net::msg_builder::get_creator<net::single_buffer_builder>(),
+		std::vector<net::msg_stage::creator>{
+			net::msg_stage::get_creator<net::checksum_stage>(std::vector<net::data_channel>{1})});
+	net::byte_buffer plain;
+	net::byte_buffer checked;
+	send(*creator(), make_payload(300), 0, plain);
+	send(*creator(), make_payload(300), 1, checked);
+	check(checked.size() == plain.size() + sizeof(net::checksum_stage::checksum_t), test,
+		  "a stage was not applied to its channels only");
+
+	checked[checked.size() / 2] ^= 0x01;
+	check_throws([&]() { receive(*creator(), checked); }, test, "a stage did not check the received payload");
+}
+} // namespace
+
+int run_builder_tests()
+{
+	test::failures() = 0;
+
+	test_round_trip(net::msg_builder::get_creator<net::single_buffer_builder>(), "single_buffer_builder");
+	test_round_trip(net::msg_builder::get_creator<net::compact_buffer_builder>(), "compact_buffer_builder");
+	test_malformed();
+	test_checksum();
+	test_fragments();
+#if defined(NETPP_WITH_ZLIB)
+	test_compression();
+#endif
+	test_pipeline();
+
+	std::cout << "builder tests : " << test::failures() << " failed\n";
+	return test::failures();
+}
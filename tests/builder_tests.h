@@ -0,0 +1,7 @@
+#pragma once
+
+//-----------------------------------------------------------------------------
+/// Round trips messages through the builders and feeds them malformed input.
+/// Returns the number of failed checks.
+//-----------------------------------------------------------------------------
+int run_builder_tests();
@@ -0,0 +1,807 @@
+#include "connection_tests.h"
+#include "test_utils.h"
+
+#include <asiopp/service.h>
+#include <builderpp/msg_builder.h>
+#include <messengerpp/messenger.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using test::check;
+using test::make_payload;
+using test::wait_until;
+
+namespace test
+{
+/// archive of the messengers of the tests, which send strings as they are
+struct text_archive
+{
+};
+} // namespace test
+
+namespace net
+{
+template <>
+struct serializer<std::string, test::text_archive, test::text_archive>
+{
+	static byte_buffer to_buffer(const std::string& msg)
+	{
+		return {std::begin(msg), std::end(msg)};
+	}
+	static std::string from_buffer(byte_buffer&& buffer)
+	{
+		return {std::begin(buffer), std::end(buffer)};
+	}
+};
+} // namespace net
+
+namespace
+{
+using received_msgs = std::vector<std::pair<net::byte_buffer, net::data_channel>>;
+
+//-----------------------------------------------------------------------------
+/// A tcp client connected to a tcp server on the loopback interface.
+/// The connections are stopped once it is destroyed.
+//-----------------------------------------------------------------------------
+struct loopback
+{
+	~loopback()
+	{
+		for(const auto& connection : {accepted, connected})
+		{
+			if(connection)
+			{
+				connection->stop(net::make_error_code(net::errc::user_triggered_disconnect));
+			}
+		}
+	}
+
+	net::connector_ptr server;
+	net::connector_ptr client;
+
+	/// connections of the server and of the client, not started yet
+	net::connection_ptr accepted;
+	net::connection_ptr connected;
+};
+
+//-----------------------------------------------------------------------------
+/// Connects a client to a server listening on the port. The connections are
+/// returned before they are started, so that subscribers can be added first.
+/// They are empty if connecting failed. Only the server sends heartbeats.
+//-----------------------------------------------------------------------------
+std::unique_ptr<loopback> connect(uint16_t port, const net::msg_builder::creator& builder,
+								  const net::connection_config& config = {},
+								  std::chrono::seconds server_heartbeat = std::chrono::seconds(0))
+{
+	auto link = std::make_unique<loopback>();
+	link->server = net::create_tcp_server(port, server_heartbeat);
+	link->client = net::create_tcp_client("::1", port, std::chrono::seconds(0), false);
+	if(!link->server || !link->client)
+	{
+		return link;
+	}
+
+	auto accepted = std::make_shared<std::promise<net::connection_ptr>>();
+	auto connected = std::make_shared<std::promise<net::connection_ptr>>();
+	link->server->on_connection_ready = [accepted](net::connection_ptr connection) {
+		accepted->set_value(std::move(connection));
+	};
+	link->client->on_connection_ready = [connected](net::connection_ptr connection) {
+		connected->set_value(std::move(connection));
+	};
+
+	for(const auto& connector : {link->server, link->client})
+	{
+		connector->create_builder = builder;
+		connector->config = config;
+		connector->start();
+	}
+
+	auto accepted_future = accepted->get_future();
+	auto connected_future = connected->get_future();
+	if(accepted_future.wait_for(std::chrono::seconds(5)) == std::future_status::ready &&
+	   connected_future.wait_for(std::chrono::seconds(5)) == std::future_status::ready)
+	{
+		link->accepted = accepted_future.get();
+		link->connected = connected_future.get();
+	}
+	return link;
+}
+
+//-----------------------------------------------------------------------------
+/// What a connection received.
+//-----------------------------------------------------------------------------
+struct inbox
+{
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(guard);
+		return msgs.size();
+	}
+
+	std::mutex guard;
+	received_msgs msgs;
+
+	/// the reason of the disconnect, once disconnected
+	net::error_code reason;
+	std::atomic<bool> disconnected{false};
+};
+
+std::shared_ptr<inbox> subscribe(net::connection& connection)
+{
+	auto received = std::make_shared<inbox>();
+	connection.on_msg.emplace_back([received](net::connection::id_t, const net::shared_buffer& msg,
+											  net::data_channel channel, const net::connection::details&) {
+		std::lock_guard<std::mutex> lock(received->guard);
+		received->msgs.emplace_back(net::byte_buffer(std::begin(msg), std::end(msg)), channel);
+	});
+	connection.on_disconnect.emplace_back([received](net::connection::id_t, const net::error_code& ec) {
+		{
+			std::lock_guard<std::mutex> lock(received->guard);
+			received->reason = ec;
+		}
+		received->disconnected = true;
+	});
+	return received;
+}
+
+void test_split_messages()
+{
+	const char* test = "split messages";
+
+	auto link = connect(11201, net::msg_builder::get_creator<net::single_buffer_builder>(false, size_t(16)));
+	if(!link->accepted)
+	{
+		check(false, test, "could not connect");
+		return;
+	}
+	auto received = subscribe(*link->accepted);
+
+	// More split messages than the peer keeps open, all queued before the
+	// connection starts, so that they are taken by the output actor at once.
+	received_msgs sent;
+	for(size_t i = 0; i < net::msg_builder::max_open_streams * 3; ++i)
+	{
+		sent.emplace_back(make_payload(100, i), i);
+		link->connected->send_msg(make_payload(100, i), i);
+	}
+	link->accepted->start();
+	link->connected->start();
+
+	check(wait_until([&]() { return received->size() == sent.size() || received->disconnected; }), test,
+		  "not all messages were received");
+	check(!received->disconnected, test, "the peer disconnected");
+
+	// Split messages take turns, so they are not received in order.
+	std::lock_guard<std::mutex> lock(received->guard);
+	std::sort(std::begin(received->msgs), std::end(received->msgs),
+			  [](const received_msgs::value_type& lhs, const received_msgs::value_type& rhs) {
+				  return lhs.second < rhs.second;
+			  });
+	check(received->msgs == sent, test, "received messages differ from the sent ones");
+}
+
+//-----------------------------------------------------------------------------
+/// Groups messages by channel, keeping their order within a channel.
+//-----------------------------------------------------------------------------
+std::map<net::data_channel, std::vector<net::byte_buffer>> by_channel(const received_msgs& msgs)
+{
+	std::map<net::data_channel, std::vector<net::byte_buffer>> channels;
+	for(const auto& msg : msgs)
+	{
+		channels[msg.second].emplace_back(msg.first);
+	}
+	return channels;
+}
+
+void test_concurrent_senders(uint16_t port, bool direct_write)
+{
+	const char* test = direct_write ? "concurrent senders direct write" : "concurrent senders";
+
+	net::connection_config config;
+	config.direct_write = direct_write;
+	auto link = connect(port, net::msg_builder::get_creator<net::single_buffer_builder>(), config);
+	if(!link->accepted)
+	{
+		check(false, test, "could not connect");
+		return;
+	}
+	auto received = subscribe(*link->accepted);
+	link->accepted->start();
+	link->connected->start();
+
+	// Every sender sends on its own channel, so its messages keep their order.
+	const size_t senders = 4;
+	const size_t msgs_per_sender = 500;
+	std::vector<std::thread> threads;
+	for(size_t sender = 0; sender < senders; ++sender)
+	{
+		threads.emplace_back([&, sender]() {
+			for(size_t i = 0; i < msgs_per_sender; ++i)
+			{
+				link->connected->send_msg(make_payload(10 + i % 1000, i), net::data_channel(sender));
+			}
+		});
+	}
+	for(auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	received_msgs sent;
+	for(size_t sender = 0; sender < senders; ++sender)
+	{
+		for(size_t i = 0; i < msgs_per_sender; ++i)
+		{
+			sent.emplace_back(make_payload(10 + i % 1000, i), net::data_channel(sender));
+		}
+	}
+
+	check(wait_until([&]() { return received->size() == sent.size() || received->disconnected; }), test,
+		  "not all messages were received");
+
+	std::lock_guard<std::mutex> lock(received->guard);
+	check(by_channel(received->msgs) == by_channel(sent), test,
+		  "the messages of a sender were not received as they were sent");
+}
+
+void test_partial_direct_write()
+{
+	const char* test = "partial direct write";
+
+	net::connection_config config;
+	config.direct_write = true;
+	auto link = connect(11206, net::msg_builder::get_creator<net::single_buffer_builder>(), config);
+	if(!link->accepted)
+	{
+		check(false, test, "could not connect");
+		return;
+	}
+	auto received = subscribe(*link->accepted);
+	link->connected->start();
+
+	// The peer does not read yet, so the socket takes only part of the big
+	// message and the rest, along with what follows, is left to the io thread.
+	received_msgs sent;
+	for(auto size : {size_t(100), size_t(8 * 1024 * 1024), size_t(100), size_t(100)})
+	{
+		sent.emplace_back(make_payload(size, sent.size()), 1);
+		link->connected->send_msg(make_payload(size, sent.size() - 1), 1);
+	}
+	link->accepted->start();
+
+	check(wait_until([&]() { return received->size() == sent.size() || received->disconnected; }), test,
+		  "not all messages were received");
+
+	std::lock_guard<std::mutex> lock(received->guard);
+	check(received->msgs == sent, test, "received messages differ from the sent ones");
+}
+
+//-----------------------------------------------------------------------------
+/// Connects with an output queue above its high watermark at 2 messages and
+/// under its low one at none. The client is not started, so that nothing
+/// drains until it is.
+//-----------------------------------------------------------------------------
+std::unique_ptr<loopback> connect_bounded(uint16_t port, net::high_water_policy overflow)
+{
+	net::connection_config config;
+	config.high_water_msgs = 2;
+	config.low_water_msgs = 0;
+	config.overflow = overflow;
+	return connect(port, net::msg_builder::get_creator<net::single_buffer_builder>(), config);
+}
+
+void test_watermarks()
+{
+	const char* test = "watermarks";
+
+	auto link = connect_bounded(11207, net::high_water_policy::drop);
+	if(!link->accepted)
+	{
+		check(false, test, "could not connect");
+		return;
+	}
+	auto received = subscribe(*link->accepted);
+	auto high_water = std::make_shared<std::atomic<int>>(0);
+	auto drained = std::make_shared<std::atomic<int>>(0);
+	link->connected->on_high_water.emplace_back([high_water](net::connection::id_t) { ++*high_water; });
+	link->connected->on_drained.emplace_back([drained](net::connection::id_t) { ++*drained; });
+
+	check(link->connected->send_msg(make_payload(10), 1) == net::send_status::queued, test,
+		  "a message under the high watermark was not queued");
+	check(link->connected->send_msg(make_payload(10), 1) == net::send_status::above_high_water, test,
+		  "reaching the high watermark was not reported");
+	check(link->connected->send_msg(make_payload(10), 1) == net::send_status::dropped, test,
+		  "a message above the high watermark was not dropped");
+	check(*high_water == 1 && *drained == 0, test, "reaching the high watermark was not notified once");
+
+	link->accepted->start();
+	link->connected->start();
+	check(wait_until([&]() { return *drained == 1; }), test, "draining to the low watermark was not notified");
+	check(link->connected->send_msg(make_payload(10), 1) == net::send_status::queued, test,
+		  "a message was not queued once drained");
+	check(wait_until([&]() { return received->size() == 3; }), test, "the queued messages were not received");
+}
+
+void test_watermark_disconnect()
+{
+	const char* test = "watermarks disconnect";
+
+	auto link = connect_bounded(11208, net::high_water_policy::disconnect);
+	if(!link->accepted)
+	{
+		check(false, test, "could not connect");
+		return;
+	}
+	auto client = subscribe(*link->connected);
+
+	link->connected->send_msg(make_payload(10), 1);
+	link->connected->send_msg(make_payload(10), 1);
+	check(link->connected->send_msg(make_payload(10), 1) == net::send_status::disconnected, test,
+		  "a message above the high watermark did not disconnect");
+	check(wait_until([&]() { return bool(client->disconnected); }), test, "the connection was not stopped");
+
+	std::lock_guard<std::mutex> lock(client->guard);
+	check(client->reason == net::make_error_code(net::errc::output_queue_full), test,
+		  "the connection was not stopped with output_queue_full");
+}
+
+void test_watermark_block()
+{
+	const char* test = "watermarks block";
+
+	auto link = connect_bounded(11209, net::high_water_policy::block);
+	if(!link->accepted)
+	{
+		check(false, test, "could not connect");
+		return;
+	}
+	auto received = subscribe(*link->accepted);
+
+	link->connected->send_msg(make_payload(10), 1);
+	link->connected->send_msg(make_payload(10), 1);
+	auto blocked = std::async(std::launch::async,
+							  [&]() { return link->connected->send_msg(make_payload(10), 1); });
+	check(blocked.wait_for(std::chrono::milliseconds(100)) == std::future_status::timeout, test,
+		  "a message above the high watermark did not block");
+
+	link->accepted->start();
+	link->connected->start();
+	check(blocked.wait_for(std::chrono::seconds(5)) == std::future_status::ready &&
+			  blocked.get() == net::send_status::queued,
+		  test, "a blocked message was not queued once drained");
+	check(wait_until([&]() { return received->size() == 3; }), test, "the queued messages were not received");
+}
+
+//-----------------------------------------------------------------------------
+/// Sends the messages on their channels before starting, so that they are
+/// all in the lanes at once, and returns the channels in the order received.
+/// Channel 1 goes on the first lane, the others on the second one.
+//-----------------------------------------------------------------------------
+std::vector<net::data_channel> receive_by_lanes(uint16_t port, const std::vector<std::size_t>& weights,
+												const std::vector<net::data_channel>& channels)
+{
+	net::connection_config config;
+	config.lane_weights = weights;
+	config.channel_lane = [](net::data_channel channel) { return channel == 1 ? 0 : 1; };
+	auto link = connect(port, net::msg_builder::get_creator<net::single_buffer_builder>(), config);
+	if(!link->accepted)
+	{
+		return {};
+	}
+	auto received = subscribe(*link->accepted);
+
+	for(auto channel : channels)
+	{
+		link->connected->send_msg(make_payload(100, channel), channel);
+	}
+	link->accepted->start();
+	link->connected->start();
+	wait_until([&]() { return received->size() == channels.size() || received->disconnected; });
+
+	std::vector<net::data_channel> order;
+	std::lock_guard<std::mutex> lock(received->guard);
+	for(const auto& msg : received->msgs)
+	{
+		order.emplace_back(msg.second);
+	}
+	return order;
+}
+
+void test_lanes()
+{
+	const char* test = "lanes";
+
+	// A lane without weight goes first.
+	std::vector<net::data_channel> sent{2, 2, 2, 2, 2, 1, 1};
+	check(receive_by_lanes(11210, {0, 1}, sent) == std::vector<net::data_channel>{1, 1, 2, 2, 2, 2, 2}, test,
+		  "a lane with strict priority did not go first");
+
+	// Otherwise lanes take turns by their weights.
+	sent = {2, 2, 2, 2, 2, 1, 1, 1, 1, 1};
+	check(receive_by_lanes(11211, {2, 1}, sent) == std::vector<net::data_channel>{1, 1, 2, 1, 1, 2, 1, 2, 2, 2},
+		  test, "the lanes did not take turns by their weights");
+}
+
+//-----------------------------------------------------------------------------
+/// Clients of a server, whose connections are started as they are ready.
+/// The connections are stopped once it is destroyed.
+//-----------------------------------------------------------------------------
+struct clients
+{
+	~clients()
+	{
+		std::lock_guard<std::mutex> lock(guard);
+		for(const auto& connection : connections)
+		{
+			connection->stop(net::make_error_code(net::errc::user_triggered_disconnect));
+		}
+	}
+
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(guard);
+		return connections.size();
+	}
+
+	std::vector<net::connector_ptr> connectors;
+
+	std::mutex guard;
+	std::vector<net::connection_ptr> connections;
+	std::vector<std::shared_ptr<inbox>> inboxes;
+};
+
+std::shared_ptr<clients> connect_clients(uint16_t port, const net::msg_builder::creator& builder, size_t count)
+{
+	auto connected = std::make_shared<clients>();
+	std::weak_ptr<clients> weak_connected = connected;
+	for(size_t i = 0; i < count; ++i)
+	{
+		auto client = net::create_tcp_client("::1", port, std::chrono::seconds(0), false);
+		if(!client)
+		{
+			continue;
+		}
+		client->create_builder = builder;
+		client->on_connection_ready = [weak_connected](net::connection_ptr connection) {
+			auto connected = weak_connected.lock();
+			if(!connected)
+			{
+				return;
+			}
+			auto received = subscribe(*connection);
+			{
+				std::lock_guard<std::mutex> lock(connected->guard);
+				connected->connections.emplace_back(connection);
+				connected->inboxes.emplace_back(received);
+			}
+			connection->start();
+		};
+		client->start();
+		connected->connectors.emplace_back(std::move(client));
+	}
+	return connected;
+}
+
+//-----------------------------------------------------------------------------
+/// Checks that each client received the messages, as strings on channel 0.
+/// Split messages take turns with the others, so the order is not checked.
+//-----------------------------------------------------------------------------
+bool received_all(clients& connected, const std::vector<std::vector<std::string>>& expected)
+{
+	std::lock_guard<std::mutex> lock(connected.guard);
+	std::vector<std::vector<std::string>> msgs;
+	for(const auto& received : connected.inboxes)
+	{
+		msgs.emplace_back();
+		std::lock_guard<std::mutex> inbox_lock(received->guard);
+		for(const auto& msg : received->msgs)
+		{
+			msgs.back().emplace_back(std::begin(msg.first), std::end(msg.first));
+			if(msg.second != 0)
+			{
+				return false;
+			}
+		}
+		std::sort(std::begin(msgs.back()), std::end(msgs.back()));
+	}
+
+	// The clients connect in no particular order.
+	std::sort(std::begin(msgs), std::end(msgs));
+	auto sorted = expected;
+	for(auto& client_msgs : sorted)
+	{
+		std::sort(std::begin(client_msgs), std::end(client_msgs));
+	}
+	std::sort(std::begin(sorted), std::end(sorted));
+	return msgs == sorted;
+}
+
+void test_broadcast()
+{
+	const char* test = "broadcast";
+
+	using messenger = net::messenger<std::string, test::text_archive, test::text_archive>;
+	auto server = messenger::create();
+
+	// A connector framing whole messages and one splitting them.
+	std::vector<net::msg_builder::creator> builders{
+		net::msg_builder::get_creator<net::single_buffer_builder>(),
+		net::msg_builder::get_creator<net::single_buffer_builder>(false, size_t(64))};
+	std::vector<net::connector::id_t> connector_ids;
+	std::vector<std::shared_ptr<clients>> connected;
+	auto accepted = std::make_shared<std::atomic<size_t>>(0);
+	auto first_accepted = std::make_shared<std::atomic<net::connection::id_t>>(0);
+	for(size_t i = 0; i < builders.size(); ++i)
+	{
+		auto port = uint16_t(11212 + i);
+		auto connector = net::create_tcp_server(port);
+		if(!connector)
+		{
+			check(false, test, "could not listen");
+			return;
+		}
+		connector->create_builder = builders[i];
+		auto on_connect = [accepted, first_accepted, i](net::connection::id_t id) {
+			net::connection::id_t none = 0;
+			if(i == 0)
+			{
+				first_accepted->compare_exchange_strong(none, id);
+			}
+			++*accepted;
+		};
+		connector_ids.emplace_back(server->add_connector(
+			connector, on_connect, [](net::connection::id_t, const net::error_code&) {},
+			[](net::connection::id_t, std::string, const net::connection::details&) {}));
+		connected.emplace_back(connect_clients(port, builders[i], 2));
+	}
+
+	if(!wait_until([&]() { return *accepted == 4 && connected[0]->size() == 2 && connected[1]->size() == 2; }))
+	{
+		check(false, test, "could not connect");
+		server->remove_all();
+		return;
+	}
+
+	std::string big(1000, 'b');
+	check(server->broadcast_all(big) == 4, test, "a message was not broadcast to all connections");
+	check(server->broadcast_connector(connector_ids[1], "connector") == 2, test,
+		  "a message was not broadcast to the connections of a connector");
+	check(server->broadcast({*first_accepted, 0}, "one") == 1, test,
+		  "a message was not broadcast to the connections given only");
+
+	check(wait_until([&]() {
+			  return received_all(*connected[0], {{big, "one"}, {big}}) &&
+					 received_all(*connected[1], {{big, "connector"}, {big, "connector"}});
+		  }),
+		  test, "the clients did not receive the broadcast messages");
+
+	server->remove_all();
+}
+
+//-----------------------------------------------------------------------------
+/// A single_buffer_builder counting the heartbeats it receives,
+/// which are messages without payload.
+//-----------------------------------------------------------------------------
+class heartbeat_counter : public net::msg_builder
+{
+public:
+	explicit heartbeat_counter(std::shared_ptr<std::atomic<size_t>> count)
+		: count_(std::move(count))
+	{
+	}
+
+	net::msg_frames build(net::byte_buffer&& msg, net::data_channel channel, bool in_place) const override
+	{
+		return builder_.build(std::move(msg), channel, in_place);
+	}
+
+	net::byte_buffer acquire_msg_buffer(net::data_channel channel) const override
+	{
+		return builder_.acquire_msg_buffer(channel);
+	}
+
+	bool process_operation(size_t size) override
+	{
+		return builder_.process_operation(size);
+	}
+
+	operation get_next_operation() const override
+	{
+		return builder_.get_next_operation();
+	}
+
+	net::byte_buffer& get_work_buffer() override
+	{
+		return builder_.get_work_buffer();
+	}
+
+	std::pair<net::byte_buffer, net::data_channel> extract_msg() override
+	{
+		auto msg = builder_.extract_msg();
+		if(msg.first.empty())
+		{
+			++*count_;
+		}
+		return msg;
+	}
+
+	void set_buffer_pool(net::buffer_pool_ptr pool) override
+	{
+		builder_.set_buffer_pool(std::move(pool));
+	}
+
+private:
+	net::single_buffer_builder builder_;
+	std::shared_ptr<std::atomic<size_t>> count_;
+};
+
+void test_heartbeat_timeout()
+{
+	const char* test = "heartbeat timeout";
+
+	// The client is not started, so it neither reads nor answers.
+	auto link = connect(11214, net::msg_builder::get_creator<net::single_buffer_builder>(), {},
+						std::chrono::seconds(1));
+	if(!link->accepted)
+	{
+		check(false, test, "could not connect");
+		return;
+	}
+	auto server = subscribe(*link->accepted);
+	link->accepted->start();
+
+	check(wait_until([&]() { return bool(server->disconnected); }), test, "a silent peer was not disconnected");
+
+	std::lock_guard<std::mutex> lock(server->guard);
+	check(server->reason == net::make_error_code(net::errc::host_unreachable), test,
+		  "a silent peer was not disconnected as unreachable");
+}
+
+//-----------------------------------------------------------------------------
+/// Runs a server with a heartbeat of a second for a few seconds, sending to
+/// its client every 'send_interval' if not 0, and back if 'both_ways'.
+/// The client has no heartbeat of its own, it only answers. Returns whether
+/// neither side was disconnected meanwhile.
+//-----------------------------------------------------------------------------
+bool run_heartbeats(uint16_t port, std::chrono::milliseconds send_interval, bool both_ways,
+					size_t& received_heartbeats)
+{
+	auto heartbeats = std::make_shared<std::atomic<size_t>>(0);
+	auto link = connect(port, [heartbeats]() { return std::make_unique<heartbeat_counter>(heartbeats); }, {},
+						std::chrono::seconds(1));
+	if(!link->accepted)
+	{
+		return false;
+	}
+	auto server = subscribe(*link->accepted);
+	auto client = subscribe(*link->connected);
+	link->accepted->start();
+	link->connected->start();
+
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(3500);
+	while(std::chrono::steady_clock::now() < end && !server->disconnected && !client->disconnected)
+	{
+		if(send_interval.count() > 0)
+		{
+			link->accepted->send_msg(make_payload(10), 1);
+			if(both_ways)
+			{
+				link->connected->send_msg(make_payload(10), 1);
+			}
+			std::this_thread::sleep_for(send_interval);
+		}
+		else
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	received_heartbeats = *heartbeats;
+	return !server->disconnected && !client->disconnected;
+}
+
+void test_heartbeats()
+{
+	const char* test = "heartbeats";
+
+	size_t heartbeats = 0;
+	check(run_heartbeats(11215, {}, false, heartbeats), test, "an idle connection was not kept alive");
+	check(heartbeats >= 3, test, "an idle connection did not send heartbeats");
+}
+
+void test_traffic_heartbeats()
+{
+	const char* test = "traffic heartbeats";
+
+	// Messages stand in for heartbeats, only those exchanged on start are sent.
+	size_t heartbeats = 0;
+	check(run_heartbeats(11216, std::chrono::milliseconds(50), true, heartbeats), test,
+		  "a connection sending messages both ways was not kept alive");
+	check(heartbeats <= 2, test, "heartbeats were sent along with the messages");
+
+	// The client sends nothing itself, so it still has to be asked to answer.
+	check(run_heartbeats(11217, std::chrono::milliseconds(50), false, heartbeats), test,
+		  "a connection sending messages one way was not kept alive");
+}
+
+void test_graceful_stop(uint16_t port, bool direct_write)
+{
+	const char* test = direct_write ? "graceful stop direct write" : "graceful stop";
+
+	net::connection_config config;
+	config.direct_write = direct_write;
+	auto link = connect(port, net::msg_builder::get_creator<net::single_buffer_builder>(), config);
+	if(!link->accepted)
+	{
+		check(false, test, "could not connect");
+		return;
+	}
+	auto server = subscribe(*link->accepted);
+	auto client = subscribe(*link->connected);
+	link->accepted->start();
+	link->connected->start();
+
+	// Sent right before stopping, so that most of it is still queued.
+	received_msgs sent;
+	for(size_t i = 0; i < 200; ++i)
+	{
+		sent.emplace_back(make_payload(i % 2 == 0 ? 100 : 100000, i), 1);
+		link->connected->send_msg(make_payload(i % 2 == 0 ? 100 : 100000, i), 1);
+	}
+
+	auto linger = std::chrono::seconds(5);
+	auto stopped_at = std::chrono::steady_clock::now();
+	link->connected->stop_gracefully(net::make_error_code(net::errc::user_triggered_disconnect), linger);
+	check(link->connected->send_msg(make_payload(10), 1) == net::send_status::disconnected, test,
+		  "a message sent while stopping was not refused");
+
+	// The peer reads everything, then sees the half close and closes its side.
+	check(wait_until([&]() { return server->disconnected && client->disconnected; }, linger * 2), test,
+		  "the connection was not stopped");
+	check(std::chrono::steady_clock::now() - stopped_at < linger, test,
+		  "the connection was stopped by the linger timeout");
+
+	std::lock_guard<std::mutex> server_lock(server->guard);
+	std::lock_guard<std::mutex> client_lock(client->guard);
+	check(server->msgs == sent, test, "not all messages queued before stopping were delivered");
+	check(client->reason == net::make_error_code(net::errc::user_triggered_disconnect), test,
+		  "the connection was not stopped with the given error");
+}
+} // namespace
+
+int run_connection_tests()
+{
+	test::failures() = 0;
+	net::init_services();
+
+	test_split_messages();
+	test_concurrent_senders(11204, false);
+	test_concurrent_senders(11205, true);
+	test_partial_direct_write();
+	test_watermarks();
+	test_watermark_disconnect();
+	test_watermark_block();
+	test_lanes();
+	test_broadcast();
+	test_heartbeat_timeout();
+	test_heartbeats();
+	test_traffic_heartbeats();
+	test_graceful_stop(11202, false);
+	test_graceful_stop(11203, true);
+
+	net::deinit_services();
+	std::cout << "connection tests : " << test::failures() << " failed\n";
+	return test::failures();
+}
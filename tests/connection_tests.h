@@ -0,0 +1,8 @@
+#pragma once
+
+//-----------------------------------------------------------------------------
+/// Sends messages between tcp connections over the loopback interface.
+/// Inits and deinits the network services itself.
+/// Returns the number of failed checks.
+//-----------------------------------------------------------------------------
+int run_connection_tests();
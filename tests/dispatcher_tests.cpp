@@ -0,0 +1,138 @@
+#include "dispatcher_tests.h"
+#include "test_utils.h"
+
+#include <messengerpp/dispatcher.h>
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using test::check;
+using test::wait_until;
+
+namespace
+{
+void test_poll()
+{
+	const char* test = "dispatcher poll";
+
+	// Shared with the polling thread, which is left behind if it hangs.
+	auto dispatcher = std::make_shared<net::dispatcher>();
+	auto order = std::make_shared<std::vector<int>>();
+	auto nested = std::make_shared<size_t>(size_t(-1));
+
+	dispatcher->dispatch(net::dispatch_policy::polled, 0, [order]() { order->push_back(1); });
+	dispatcher->dispatch(net::dispatch_policy::polled, 0, [dispatcher, order, nested]() {
+		*nested = dispatcher->poll();
+		order->push_back(2);
+	});
+	dispatcher->dispatch(net::dispatch_policy::polled, 0, []() { throw std::runtime_error("test"); });
+	dispatcher->dispatch(net::dispatch_policy::polled, 0, [order]() { order->push_back(4); });
+
+	auto polled = std::make_shared<std::atomic<size_t>>(0);
+	auto done = std::make_shared<std::atomic<bool>>(false);
+	std::thread([dispatcher, polled, done]() {
+		*polled = dispatcher->poll();
+		*done = true;
+	}).detach();
+
+	if(!wait_until([&]() { return bool(*done); }))
+	{
+		check(false, test, "polling from a callback hung");
+		return;
+	}
+	check(*nested == 0, test, "polling from a callback ran callbacks");
+	check(*polled == 4, test, "not all callbacks were run");
+	check(*order == std::vector<int>{1, 2, 4}, test, "callbacks were not run in order");
+
+	for(int i = 0; i < 3; ++i)
+	{
+		dispatcher->dispatch(net::dispatch_policy::polled, 0, []() {});
+	}
+	check(dispatcher->poll(2) == 2 && dispatcher->poll() == 1, test, "the callbacks run were not limited");
+}
+
+void test_worker_pool()
+{
+	const char* test = "dispatcher worker pool";
+
+	constexpr size_t keys = 64;
+	constexpr size_t tasks_per_key = 2000;
+	constexpr size_t producers = 4;
+
+	struct key_state
+	{
+		/// index of the next callback expected to run
+		size_t next{};
+		std::atomic<bool> running{false};
+	};
+	std::vector<key_state> states(keys);
+	std::atomic<size_t> run_count{0};
+	std::atomic<size_t> overlapped{0};
+	std::atomic<size_t> reordered{0};
+	std::mutex threads_guard;
+	std::set<std::thread::id> worker_threads;
+
+	net::dispatcher dispatcher;
+	dispatcher.set_workers(4);
+
+	// Every producer owns some of the keys, so the order of their callbacks is known.
+	std::vector<std::thread> threads;
+	for(size_t p = 0; p < producers; ++p)
+	{
+		threads.emplace_back([&, p]() {
+			for(size_t i = 0; i < tasks_per_key; ++i)
+			{
+				for(size_t key = p; key < keys; key += producers)
+				{
+					dispatcher.dispatch(net::dispatch_policy::worker_pool, key, [&, key, i]() {
+						auto& state = states[key];
+						if(state.running.exchange(true))
+						{
+							overlapped++;
+						}
+						{
+							std::lock_guard<std::mutex> lock(threads_guard);
+							worker_threads.insert(std::this_thread::get_id());
+						}
+
+						if(state.next != i)
+						{
+							reordered++;
+						}
+						state.next = i + 1;
+
+						state.running = false;
+						run_count++;
+					});
+				}
+			}
+		});
+	}
+	for(auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	check(wait_until([&]() { return run_count == keys * tasks_per_key; }), test, "not all callbacks were run");
+	check(overlapped == 0, test, "callbacks of the same key ran at the same time");
+	check(reordered == 0, test, "callbacks of the same key ran out of order");
+	check(worker_threads.size() > 1, test, "callbacks were not spread over the workers");
+}
+} // namespace
+
+int run_dispatcher_tests()
+{
+	test::failures() = 0;
+
+	test_poll();
+	test_worker_pool();
+
+	std::cout << "dispatcher tests : " << test::failures() << " failed\n";
+	return test::failures();
+}
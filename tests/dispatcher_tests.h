@@ -0,0 +1,7 @@
+#pragma once
+
+//-----------------------------------------------------------------------------
+/// Runs callbacks through the dispatcher with every dispatch policy.
+/// Returns the number of failed checks.
+//-----------------------------------------------------------------------------
+int run_dispatcher_tests();
@@ -1,3 +1,8 @@
+#include "builder_tests.h"
+#include "connection_tests.h"
+#include "dispatcher_tests.h"
+#include "registry_tests.h"
+
 #include <asiopp/service.h>
 #include <messengerpp/messenger.h>
 #include <builderpp/msg_builder.h>
@@ -45,6 +50,10 @@ struct serializer<std::string, std::stringstream, std::stringstream>
 	{
 		return {std::begin(buffer), std::end(buffer)};
 	}
+	static std::string from_buffer(const shared_buffer& buffer)
+	{
+		return {std::begin(buffer), std::end(buffer)};
+	}
 };
 
 template <typename T>
@@ -157,11 +166,27 @@ int main(int argc, char* argv[])
 {
 	if(argc < 2)
 	{
-		std::cerr << "Usage: <server/client/both>"
+		std::cerr << "Usage: <server/client/both/builders/connections/dispatcher/registry>"
 				  << "\n";
 		return 0;
 	}
 	std::string what = argv[1];
+	if(what == "builders")
+	{
+		return run_builder_tests() == 0 ? 0 : 1;
+	}
+	if(what == "connections")
+	{
+		return run_connection_tests() == 0 ? 0 : 1;
+	}
+	if(what == "dispatcher")
+	{
+		return run_dispatcher_tests() == 0 ? 0 : 1;
+	}
+	if(what == "registry")
+	{
+		return run_registry_tests() == 0 ? 0 : 1;
+	}
 	int count = 1;
 	if(argc == 3)
 	{
@@ -184,7 +209,7 @@ int main(int argc, char* argv[])
 	}
 	else
 	{
-		std::cerr << "Usage: <server/client/both>"
+		std::cerr << "Usage: <server/client/both/builders/connections/dispatcher/registry>"
 				  << "\n";
 		return 1;
 	}
@@ -0,0 +1,133 @@
+#include "registry_tests.h"
+#include "test_utils.h"
+
+#include <messengerpp/connection_registry.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using test::check;
+
+namespace
+{
+/// Values are freed along with the nodes holding them,
+/// so reading a node freed too early shows in a sanitized build.
+using value_type = std::shared_ptr<const net::connection::id_t>;
+using registry = net::connection_registry<value_type>;
+
+void insert(registry& connections, net::connection::id_t id)
+{
+	connections.insert(id, net::connector::id_t(id % 3), std::make_shared<const net::connection::id_t>(id));
+}
+
+bool holds(const registry& connections, net::connection::id_t id)
+{
+	value_type value;
+	return connections.find(id, value) && value && *value == id;
+}
+
+void test_registry()
+{
+	const char* test = "connection_registry";
+
+	registry connections;
+	check(connections.empty(), test, "a new registry is not empty");
+
+	// Enough to grow every shard a few times.
+	const net::connection::id_t count = 3000;
+	for(net::connection::id_t id = 1; id <= count; ++id)
+	{
+		insert(connections, id);
+	}
+	for(net::connection::id_t id = 2; id <= count; id += 2)
+	{
+		connections.erase(id);
+	}
+	connections.erase(count + 1);
+
+	bool found = true;
+	for(net::connection::id_t id = 1; id <= count; ++id)
+	{
+		found &= holds(connections, id) == (id % 2 == 1);
+	}
+	check(found, test, "the connections found differ from the inserted ones");
+	check(connections.get_all().size() == count / 2, test, "not all connections were got");
+
+	auto by_connector = connections.get_connector(1);
+	check(std::all_of(std::begin(by_connector), std::end(by_connector),
+					  [](const value_type& value) { return *value % 3 == 1 && *value % 2 == 1; }) &&
+			  by_connector.size() == count / 6,
+		  test, "the connections of a connector differ from the inserted ones");
+
+	check(connections.extract_all().size() == count / 2 && connections.empty() && !holds(connections, 1), test,
+		  "not all connections were extracted");
+}
+
+void test_concurrent_lookups()
+{
+	const char* test = "connection_registry concurrent lookups";
+
+	registry connections;
+
+	// Looked up all along, while the others come and go around them.
+	const net::connection::id_t stable = 256;
+	for(net::connection::id_t id = 1; id <= stable; ++id)
+	{
+		insert(connections, id);
+	}
+
+	std::atomic<bool> done{false};
+	std::atomic<size_t> missed{0};
+	std::vector<std::thread> readers;
+	for(int i = 0; i < 4; ++i)
+	{
+		readers.emplace_back([&, i]() {
+			net::connection::id_t id = 1 + net::connection::id_t(i);
+			while(!done)
+			{
+				if(!holds(connections, id))
+				{
+					++missed;
+				}
+				connections.get_all();
+				id = id % stable + 1;
+			}
+		});
+	}
+
+	for(int round = 0; round < 20; ++round)
+	{
+		for(net::connection::id_t id = stable + 1; id <= stable * 4; ++id)
+		{
+			insert(connections, id);
+		}
+		for(net::connection::id_t id = stable + 1; id <= stable * 4; ++id)
+		{
+			connections.erase(id);
+		}
+	}
+	done = true;
+	for(auto& reader : readers)
+	{
+		reader.join();
+	}
+
+	check(missed == 0, test, "a connection was not found while others were removed");
+	check(connections.get_all().size() == stable, test, "connections were lost");
+}
+} // namespace
+
+int run_registry_tests()
+{
+	test::failures() = 0;
+
+	test_registry();
+	test_concurrent_lookups();
+
+	std::cout << "registry tests : " << test::failures() << " failed\n";
+	return test::failures();
+}
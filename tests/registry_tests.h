@@ -0,0 +1,7 @@
+#pragma once
+
+//-----------------------------------------------------------------------------
+/// Looks up connections in the registry while others are added and removed.
+/// Returns the number of failed checks.
+//-----------------------------------------------------------------------------
+int run_registry_tests();
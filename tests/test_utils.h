@@ -0,0 +1,77 @@
+#pragma once
+#include <netpp/byte_buffer.h>
+
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <thread>
+
+namespace test
+{
+
+//-----------------------------------------------------------------------------
+/// Number of failed checks of the running suite.
+//-----------------------------------------------------------------------------
+inline int& failures()
+{
+	static int count = 0;
+	return count;
+}
+
+inline void check(bool condition, const char* test, const char* what)
+{
+	if(!condition)
+	{
+		std::cerr << "[" << test << "] failed: " << what << "\n";
+		++failures();
+	}
+}
+
+//-----------------------------------------------------------------------------
+/// Makes a payload whose bytes differ with their offset and the seed.
+//-----------------------------------------------------------------------------
+inline net::byte_buffer make_payload(size_t size, size_t seed = 0)
+{
+	net::byte_buffer payload(size);
+	for(size_t i = 0; i < size; ++i)
+	{
+		payload[i] = uint8_t((i + seed) * 7 ^ (i >> 3) * 13);
+	}
+	return payload;
+}
+
+template <typename F>
+void check_throws(F&& f, const char* test, const char* what)
+{
+	bool thrown = false;
+	try
+	{
+		f();
+	}
+	catch(const std::exception&)
+	{
+		thrown = true;
+	}
+	check(thrown, test, what);
+}
+
+//-----------------------------------------------------------------------------
+/// Waits until the condition holds, for a few seconds at most.
+/// Returns whether it holds.
+//-----------------------------------------------------------------------------
+template <typename F>
+bool wait_until(F&& condition, std::chrono::milliseconds timeout = std::chrono::seconds(5))
+{
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	while(!condition())
+	{
+		if(std::chrono::steady_clock::now() > deadline)
+		{
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+} // namespace test